@@ -0,0 +1,98 @@
+/*
+ * Benchmarks lenv lookups to find where hashing beats a linear scan.
+ *
+ * Builds the interpreter with every frame indexed, then times looking up
+ * every name in frames of increasing size both through the hash index and
+ * with the plain scan small frames use. The first size where the index
+ * wins is the crossover, LENV_HASH_MIN in lisperer.c should sit just below
+ * it. Also times defining and reading back large numbers of globals.
+ *
+ * cc -std=c11 -O2 bench/lenv_bench.c mpc.c -ledit -lm -o lenv_bench
+ */
+
+/* lisperer.c needs this for the jit, before any system header */
+#define _DEFAULT_SOURCE
+#include <time.h>
+
+/* index every frame, and take over main */
+#define LENV_HASH_MIN 0
+#define main lisperer_main
+#include "../lisperer.c"
+#undef main
+
+/* the scan lenv_find does for frames without an index */
+int scan_find(lenv* e, char* sym) {
+    for(int i = 0; i < e->count; i++) {
+        if(e->syms[i] == sym) {return i;}
+    }
+    return -1;
+}
+
+double seconds(void) {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/* builds a frame binding n distinct names */
+lenv* bench_frame(int n, lval** keys) {
+    lenv* e = lenv_new();
+    lval* v = lval_num(0);
+    char name[32];
+    for(int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "bench_%i", i);
+        keys[i] = lval_sym(name);
+        lenv_put(e, keys[i], v);
+    }
+    lval_del(v);
+    return e;
+}
+
+int main(int argc, char** argv) {
+    lsym_init();
+    gc_init();
+    
+    /* frame lookups - every name looked up the same number of times */
+    long lookups = 20000000;
+    lval* keys[128];
+    volatile int sink = 0;
+    puts("frame size   scan ns/lookup   hash ns/lookup");
+    for(int n = 1; n <= 128; n *= 2) {
+        lenv* e = bench_frame(n, keys);
+        long rounds = lookups / n;
+        
+        double t = seconds();
+        for(long r = 0; r < rounds; r++) {
+            for(int i = 0; i < n; i++) {sink += scan_find(e, keys[i]->sym);}
+        }
+        double scan = seconds() - t;
+        
+        t = seconds();
+        for(long r = 0; r < rounds; r++) {
+            for(int i = 0; i < n; i++) {sink += lenv_find(e, keys[i]->sym);}
+        }
+        double hash = seconds() - t;
+        
+        printf("%10i   %14.2f   %14.2f\n", n,
+            scan * 1e9 / (rounds * n), hash * 1e9 / (rounds * n));
+        for(int i = 0; i < n; i++) {lval_del(keys[i]);}
+        lenv_del(e);
+    }
+    
+    /* defining then reading back many globals */
+    puts("\n   globals     def ms     get ms");
+    for(int n = 10000; n <= 80000; n *= 2) {
+        lval** many = malloc(sizeof(lval*) * n);
+        double t = seconds();
+        lenv* e = bench_frame(n, many);
+        double def = seconds() - t;
+        
+        t = seconds();
+        for(int i = 0; i < n; i++) {lval_del(lenv_get(e, many[i]));}
+        double get = seconds() - t;
+        
+        printf("%10i %10.2f %10.2f\n", n, def * 1e3, get * 1e3);
+        for(int i = 0; i < n; i++) {lval_del(many[i]);}
+        free(many);
+        lenv_del(e);
+    }
+    return sink == 42;
+}
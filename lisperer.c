@@ -1,6 +1,25 @@
+/* mmap's MAP_ANONYMOUS, used by the jit, is hidden in strict c11 mode */
+/* this only works before the first system header, anything including */
+/* this file must define it first too */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+/* arrays of numbers use SSE2 and AVX2 on x86-64 */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LARR_SIMD 1
+#endif
+/* hot functions are compiled to x86-64 machine code on linux */
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define LJIT 1
+#endif
 /* header for the parser combinator - for creating our grammer */
 #include "mpc.h"
 
@@ -39,15 +58,28 @@ void add_history(char* unused) {}
         }
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT(args, ltype(args->cell[index]) == expect, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
-    func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+    func, index, ltype_name(ltype(args->cell[index])), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
   LASSERT(args, args->count == num, \
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
     func, args->count, num)
 
+#define LASSERT_LIST(func, args, index) \
+  LASSERT(args, ltype(args->cell[index]) == LVAL_QEXPR \
+    || ltype(args->cell[index]) == LVAL_VEC, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(ltype(args->cell[index])), ltype_name(LVAL_QEXPR))
+
+#define LASSERT_NUMBER(func, args, index) \
+  LASSERT(args, ltype(args->cell[index]) == LVAL_NUM \
+    || ltype(args->cell[index]) == LVAL_BIG \
+    || ltype(args->cell[index]) == LVAL_DBL, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(ltype(args->cell[index])), ltype_name(LVAL_NUM))
+
 #define LASSERT_NOT_EMPTY(func, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
@@ -55,8 +87,10 @@ void add_history(char* unused) {}
 /* forward declare types */
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
 
 /* forward declare parsers */
 mpc_parser_t* Number; 
@@ -70,49 +104,548 @@ mpc_parser_t* Lispy;
 
 /* enum of possible lval types */
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR,
-    LVAL_SEXPR, LVAL_FUN, LVAL_QEXPR, LVAL_EXIT };
+    LVAL_SEXPR, LVAL_FUN, LVAL_QEXPR, LVAL_EXIT, LVAL_VEC, LVAL_BIG,
+    LVAL_DBL, LVAL_ARR, LVAL_MAT };
     
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
-/* declare lval structure*/
-struct lval{
-    int type;
-    
-    long num;
-    /* Error and Symbol types have some string data*/
-    char* err;
-    char* sym;
-    char* str;
-    
-    /* Function */
-    lbuiltin builtin;
+/* operators handled by builtin_op, builtin_ord and builtin_cmp */
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MOD, LOP_POW,
+    LOP_GT, LOP_LT, LOP_GE, LOP_LE, LOP_EQ, LOP_NE };
+
+/* operator names, for error messages */
+char* lop_names[] = { "+", "-", "*", "/", "%", "^",
+    ">", "<", ">=", "<=", "==", "!=" };
+
+/* a user defined function, kept out of line so every lval stays small */
+/* formals, body and code are never changed, so partial applications */
+/* share them with the function and only add the arguments given so far */
+typedef struct {
+    /* the environment the function was written in */
     lenv* env;
     lval* formals;
     lval* body;
+    /* compiled body, shared between copies of the function */
+    lcode* code;
+    /* arguments already given to a partial application, or NULL */
+    lval* args;
+} lfunc;
+
+/* a vector is a balanced tree of runs of items in flat q-expressions, */
+/* so they can be indexed, joined and sliced in O(log n) without copying */
+/* a run has a base list, a node has a left and right vector */
+typedef struct {
+    lval* left;
+    lval* right;
+    int depth;
+    lval* base;
+    int off;
+} lvec;
+
+/* runs shorter than this are copied when joined rather than shared */
+#define LVEC_RUN 32
+
+/* an integer too big for a long - the magnitude is stored as base 2^32 */
+/* limbs, lowest first, in the same allocation as this header */
+typedef struct {
+    int neg;
+    int n;
+    uint32_t* d;
+} lbig;
+
+/* big numbers with at least this many limbs multiply by Karatsuba */
+#define LBIG_KARATSUBA 32
+
+/* the largest result, in limbs, that ^ will work out */
+#define LBIG_MAX_LIMBS (1 << 21)
+
+/* a flat array of numbers, all 64 bit integers or all decimals, */
+/* stored in the same allocation as this header */
+typedef struct {
+    int dbl;
+    union {
+        int64_t* i;
+        double* f;
+    };
+} larr;
+
+/* reductions over arrays */
+enum { LARR_SUM, LARR_MIN, LARR_MAX, LARR_DOT };
+
+/* a row-major matrix of decimals, stored after this header */
+typedef struct {
+    int rows;
+    int cols;
+    double* d;
+} lmat;
+
+/* matrices are multiplied and transposed in tiles of this many rows */
+/* and columns, small enough for three to fit in cache together */
+#define LMAT_BLOCK 64
+
+/* declare lval structure - 24 bytes, the payload depends on the type */
+struct lval{
+    unsigned char type;
+    /* collector generation and flags */
+    unsigned char gen;
+    unsigned char gc_flags;
+    /* lvals are shared between owners and copied before being changed */
+    int refs;
+    /* collector scratch count */
+    int gc_refs;
     
     /* Expression */
     int count;
-    lval** cell;
+    
+    union {
+        long num;
+        double dbl;
+        /* Error and Symbol types have some string data*/
+        char* err;
+        char* sym;
+        char* str;
+        
+        /* Function - builtins are tagged immediates so this is a lambda */
+        lfunc* fn;
+        
+        /* Vector */
+        lvec* vec;
+        
+        /* Big number */
+        lbig* big;
+        
+        /* Array of numbers */
+        larr* arr;
+        
+        /* Matrix */
+        lmat* mat;
+        
+        /* Expression */
+        lval** cell;
+    };
 };
 
+/* lists keep this many cells inline and only use an array past it */
+#ifndef LVAL_INLINE
+#define LVAL_INLINE 4
+#endif
+
+/* S and Q expressions are allocated with room for their first cells */
+/* cell points at the first item, start slots into a buffer of cap slots */
+/* so popping the front just moves cell along */
+typedef struct {
+    lval v;
+    int cap;
+    int start;
+    lval* inl[LVAL_INLINE];
+} llist;
+
+#define LLIST(v) ((llist*)(v))
+#define LVAL_IS_LIST(type) ((type) == LVAL_SEXPR || (type) == LVAL_QEXPR)
+
+/* small values are stored in the lval pointer itself, not on the heap */
+/* lvals are 8 byte aligned so the low bits are free to mark them - a set */
+/* low bit is a fixnum, 010 a builtin stored as its index in builtins */
+#define LTAG_FIXNUM 1
+#define LTAG_BUILTIN 2
+#define LTAG_MASK 7
+#define LVAL_IMM(v) (((uintptr_t)(v) & LTAG_MASK) != 0)
+
+/* numbers outside this range are stored in an LVAL_NUM on the heap */
+#define LFIX_MAX (LONG_MAX / 2)
+#define LFIX_MIN (LONG_MIN / 2)
+
+/* declare the builtin table - every builtin function is stored once */
+#define LBUILTIN_MAX 64
+lbuiltin builtins[LBUILTIN_MAX];
+int nbuiltins;
+
+/* the type of an lval, immediate or not */
+static inline int ltype(lval* v) {
+    if((uintptr_t)v & LTAG_FIXNUM) {return LVAL_NUM;}
+    if((uintptr_t)v & LTAG_BUILTIN) {return LVAL_FUN;}
+    return v->type;
+}
+
+/* the value of a number */
+static inline long lnum(lval* v) {
+    if((uintptr_t)v & LTAG_FIXNUM) {return (long)((intptr_t)v >> 1);}
+    return v->num;
+}
+
+/* the builtin a function calls, NULL for a lambda */
+static inline lbuiltin lval_builtin(lval* v) {
+    if((uintptr_t)v & LTAG_BUILTIN) {return builtins[(uintptr_t)v >> 3];}
+    return NULL;
+}
+
+/* the empty lists are shared by everyone and never freed */
+#define LVAL_IMMORTAL (INT_MAX / 2)
+llist lval_empty_sexpr = { { .type = LVAL_SEXPR, .refs = LVAL_IMMORTAL,
+    .cell = lval_empty_sexpr.inl }, .cap = LVAL_INLINE };
+llist lval_empty_qexpr = { { .type = LVAL_QEXPR, .refs = LVAL_IMMORTAL,
+    .cell = lval_empty_qexpr.inl }, .cap = LVAL_INLINE };
+
+/* frames with more bindings than this also get a hash index */
+/* below it a linear scan is faster, see bench/lenv_bench.c for the crossover */
+#ifndef LENV_HASH_MIN
+#define LENV_HASH_MIN 6
+#endif
+
 /* declare lenv structure */
 struct lenv {
     lenv* par;
+    /* closures and copies share their parent, the global env is never counted */
+    int refs;
+    unsigned char gen;
+    unsigned char gc_flags;
+    /* set once '=' adds a name to a frame after its arguments are bound */
+    unsigned char grown;
+    int gc_refs;
     int count;
+    int cap;
+    /* bindings in the order they were made - slot i is syms[i], vals[i] */
     char** syms;
     lval** vals;
+    /* open addressing table of slot+1 keyed by name, 0 is empty */
+    int* index;
+    int index_cap;
+};
+
+/* a pool of fixed size objects carved out of large chunks */
+/* new objects are bump allocated, freed ones are reused first */
+typedef struct {
+    size_t size;
+    int per_chunk;
+    char** chunks;
+    int nchunks;
+    /* bump allocation point in the newest chunk */
+    int used;
+    /* freed objects waiting to be reused */
+    void** free;
+    int nfree;
+    int free_cap;
+    /* objects handed out in total and still in use */
+    long allocs;
+    long live;
+} lpool;
+
+/* pointer arrays are rounded up to a power of two items, and those up */
+/* to 2^(LSLAB_CLASSES-1) items come from a pool for their size class */
+#define LSLAB_CLASSES 7
+
+/* objects allocated since the last collection, then the survivors */
+enum { GEN_YOUNG, GEN_OLD };
+
+/* flags set on objects while collecting */
+enum { GC_CANDIDATE = 1, GC_LIVE = 2 };
+
+/* young objects allocated before a minor collection runs */
+#ifndef GC_NURSERY
+#define GC_NURSERY 65536
+#endif
+
+/* references released by default in one step of freeing dead objects */
+#ifndef GC_BUDGET
+#define GC_BUDGET 4096
+#endif
+
+/* pause histogram buckets, bucket i counts pauses under 2^i microseconds */
+#define GC_PAUSE_BUCKETS 24
+
+/* declare the collector state - lvals and lenvs live in its pools */
+/* reference counting frees almost everything, the collector finds the */
+/* cycles it can't - closures stored into the frame they capture */
+struct {
+    lpool vals;
+    lpool lists;
+    lpool envs;
+    lpool funcs;
+    lpool vecs;
+    /* cell arrays and lenv variable arrays */
+    lpool slabs[LSLAB_CLASSES];
+    /* lvals allocated of each type */
+    long val_allocs[LVAL_MAT+1];
+    /* objects allocated since the last collection */
+    lval** young_vals;
+    int nyoung_vals;
+    int young_vals_cap;
+    lenv** young_envs;
+    int nyoung_envs;
+    int young_envs_cap;
+    /* old generation size now and after the last full collection */
+    long old;
+    long old_at_major;
+    /* objects whose last reference has gone, freed a step at a time */
+    lval** dead_vals;
+    int ndead_vals;
+    int dead_vals_cap;
+    lenv** dead_envs;
+    int ndead_envs;
+    int dead_envs_cap;
+    /* the objects and references the dead still hold */
+    long dead_work;
+    /* the work done in one step, plus what was allocated since the last */
+    /* one so freeing keeps pace with a program that allocates quickly */
+    long budget;
+    long debt;
+    /* how long the collector has paused evaluation for */
+    long pauses[GC_PAUSE_BUCKETS];
+    long npauses;
+    double pause_max;
+} gc;
+
+/* declare the symbol table - every symbol name is stored once */
+/* symbols and lenv keys point at these so are compared by pointer */
+struct {
+    char** names;
+    int count;
+    int cap;
+} symtab;
+
+/* interned names the evaluator checks for */
+char* sym_amp;
+char* sym_if;
+char* sym_put;
+char* sym_def;
+char* sym_eval;
+char* sym_load;
+char* sym_lambda;
+
+/* vectors in use - builtins only check their arguments for them if any */
+long lvec_live;
+
+/* whether array kernels can use AVX2, checked once at startup */
+int larr_avx2;
+
+/* the global environment, and a count of the bindings made in it */
+/* global loads cache the slot they found a name in, and only look */
+/* the name up again once the count has moved on */
+lenv* lenv_root;
+unsigned lenv_version;
+
+/* ids given to chunks of code so far */
+unsigned long lcode_ids;
+
+/* frames given new names by '=' - compiled code resolves names against */
+/* the frames it was first run in, so while there are any it checks the */
+/* frames it looked past haven't since been given the name */
+long lenv_grown;
+
+/* which evaluator lval_exec hands expressions to */
+enum { EVAL_VM, EVAL_TREE };
+int eval_mode = EVAL_VM;
+
+/* bytecode instructions - operands follow the opcode in the ops array */
+enum { OP_CONST, OP_SYM, OP_LOCAL, OP_MOVE, OP_GLOBAL,
+    OP_CALL, OP_TAILCALL, OP_IF, OP_JUMP, OP_RET };
+
+/* how many lists deep the compiler tracks the code still to run */
+#define LSCOPE_DEPTH 32
+
+/* what the compiler knows about the frames a function body runs in */
+typedef struct {
+    /* the function's frame, its parents are the enclosing frames */
+    lenv* env;
+    /* names the body binds with '=' - these are always looked up by name */
+    lval* dyn;
+    /* set if the body binds names we can't see, so nothing is resolved */
+    int open;
+    /* set if the body may look in its frame again after a value has been */
+    /* moved out of it, so nothing is moved */
+    int keep;
+    /* the code run after the expression being compiled, as the lists */
+    /* it is in and the first of their cells still to run, innermost last */
+    lval* later[LSCOPE_DEPTH];
+    int later_at[LSCOPE_DEPTH];
+    int nlater;
+} lscope;
+
+/* declare lcode structure - a compiled chunk of bytecode */
+struct lcode {
+    int refs;
+    int count;
+    int cap;
+    int* ops;
+    int nconsts;
+    lval** consts;
+    /* tells chunks apart, as a freed chunk's memory may be reused */
+    unsigned long id;
+    /* calls made by the interpreter, -1 once it can't be compiled */
+    int calls;
+    struct ljit* jit;
+    /* the optimiser's epoch when compiled, stale once it has moved on */
+    unsigned epoch;
 };
 
+/* machine code for a hot function, shared with its bytecode */
+typedef struct ljit {
+    unsigned char* mem;
+    size_t size;
+    int nparams;
+    /* the globals the code called, and the builtin each was bound to */
+    /* or, for a user defined function, the id of its chunk - checked */
+    /* again after any def */
+    int nguards;
+    char** guards;
+    lval** expect;
+    unsigned long* ids;
+    unsigned version;
+    /* how many times the code has bailed out to the interpreter */
+    int bails;
+} ljit;
+
+/* lambdas are compiled to machine code after this many calls, 0 never */
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+long jit_threshold = JIT_THRESHOLD;
+
+/* how many functions, the one called and those it calls, are compiled */
+/* into one piece of machine code */
+#define LJIT_MAX_FUNCS 8
+
+/* machine code being assembled for a function */
+typedef struct {
+    unsigned char* b;
+    int n;
+    int cap;
+    /* the function being compiled */
+    int cur;
+    lval* formals;
+    int nparams;
+    /* offsets of the bail out code and the body being compiled */
+    int bail;
+    int body;
+    /* the functions compiled into the code, the one called first then */
+    /* the globals it calls, and where each starts */
+    int nfuncs;
+    lval* funcs[LJIT_MAX_FUNCS];
+    int starts[LJIT_MAX_FUNCS];
+    /* the function the last call found by lasm_global was to */
+    int callee;
+    /* calls and the functions they go to, filled in once all are compiled */
+    int ncalls;
+    int* calls;
+    int* calls_to;
+    int nguards;
+    char** guards;
+    lval** expect;
+    unsigned long* ids;
+} lasm;
+
+/* code is optimised as it is loaded - calls to builtins on literals are */
+/* folded and ifs on a literal condition are pruned, in function bodies */
+/* bodies are changed in place, so the functions sharing them see it, */
+/* and every list changed is kept with its old items so that it can be */
+/* put back if one of the globals the optimiser relied on is rebound */
+typedef struct {
+    lval* list;
+    lval* old;
+} lopt_site;
+
+struct {
+    int enabled;
+    lopt_site* sites;
+    int nsites;
+    int cap;
+    /* the globals the changes relied on */
+    char** deps;
+    int ndeps;
+    int deps_cap;
+    /* moved on each time the changes are put back */
+    unsigned epoch;
+    long folds;
+    long prunes;
+    long inlines;
+    long removed;
+    long restores;
+} lopt = { .enabled = 1 };
+
+/* what the optimiser knows about the function bodies it is in */
+typedef struct {
+    /* names bound locally, which may hide the builtins */
+    lval* hidden;
+    /* set inside a function body, where calls are folded */
+    int fold;
+    /* set inside a body just inlined, which isn't inlined into again */
+    int inlined;
+    /* set once the body has called something that may redefine a global */
+    /* and so put back the code after it while it runs */
+    int called;
+    /* the functions the body has called so far that can't, which any */
+    /* change after them relies on */
+    lval* calm;
+} lopt_scope;
+
+/* functions whose bodies have up to this many values are inlined */
+#ifndef LOPT_INLINE
+#define LOPT_INLINE 16
+#endif
+
+/* how many calls deep a function is looked through to see it is calm */
+#define LOPT_CALM_DEPTH 8
+
+/* a single activation record on the vm frame stack */
+typedef struct {
+    lcode* code;
+    int pc;
+    lenv* env;
+    /* the function being run and its frame's environment, both owned */
+    /* by the frame (fn is NULL at top level, where env isn't owned) */
+    lval* fn;
+} lframe;
+
+/* the vm value stack and frame stack, shared by nested runs */
+struct {
+    lval** stack;
+    int sp;
+    int stack_cap;
+    lframe* frames;
+    int nframes;
+    int frames_cap;
+} vm;
+
 /* declare eval methods - (bodies are directly after main) */
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_exec(lenv* e, lval* v);
 lval* builtin(lval* a, char* func);
 lval* builtin_def(lenv* e, lval* a);
+lval* builtin_fun(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
 lval* builtin_var(lenv* e, lval* a, char* func);
-lval* builtin_op(lenv* e, lval* a, char* op);
-lval* builtin_ord(lenv* e, lval* a, char* op);
-lval* builtin_cmp(lenv* e, lval* a, char* op);
+lval* builtin_op(lenv* e, lval* a, int op);
+lval* builtin_ord(lenv* e, lval* a, int op);
+lval* builtin_op_dbl(lval* a, int op, int dbls);
+lval* builtin_math(lval* a, char* func, double (*f)(double));
+lval* builtin_sqrt(lenv* e, lval* a);
+lval* builtin_exp(lenv* e, lval* a);
+lval* builtin_log(lenv* e, lval* a);
+lval* builtin_sin(lenv* e, lval* a);
+lval* builtin_cos(lenv* e, lval* a);
+lval* builtin_floor(lenv* e, lval* a);
+lval* builtin_array(lenv* e, lval* a);
+lval* builtin_array_list(lenv* e, lval* a);
+lval* builtin_op_arr(lval* a, int op);
+lval* builtin_ord_arr(lval* a, int op);
+lval* builtin_fold(lval* a, int op, char* func);
+lval* builtin_sum(lenv* e, lval* a);
+lval* builtin_min(lenv* e, lval* a);
+lval* builtin_max(lenv* e, lval* a);
+lval* builtin_dot(lenv* e, lval* a);
+lval* builtin_matrix(lenv* e, lval* a);
+lval* builtin_reshape(lenv* e, lval* a);
+lval* builtin_shape(lenv* e, lval* a);
+lval* builtin_matmul(lenv* e, lval* a);
+lval* builtin_transpose(lenv* e, lval* a);
+lval* builtin_slice_mat(lval* a, char* func, int col);
+lval* builtin_row(lenv* e, lval* a);
+lval* builtin_col(lenv* e, lval* a);
+lval* builtin_sums_mat(lval* a, char* func, int col);
+lval* builtin_row_sums(lenv* e, lval* a);
+lval* builtin_col_sums(lenv* e, lval* a);
+lval* builtin_cmp(lenv* e, lval* a, int op);
 lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
@@ -122,7 +655,14 @@ lval* builtin_add(lenv* e, lval* a);
 lval* builtin_sub(lenv* e, lval* a);
 lval* builtin_mul(lenv* e, lval* a);
 lval* builtin_div(lenv* e, lval* a);
+lval* builtin_mod(lenv* e, lval* a);
+lval* builtin_pow(lenv* e, lval* a);
 lval* builtin_lenv_print(lenv* e, lval* a);
+lval* builtin_gc_stats(lenv* e, lval* a);
+lval* builtin_gc_budget(lenv* e, lval* a);
+lval* builtin_jit_threshold(lenv* e, lval* a);
+lval* builtin_mem_stats(lenv* e, lval* a);
+lval* builtin_opt_stats(lenv* e, lval* a);
 lval* builtin_lambda(lenv* e, lval* a);
 lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_lt(lenv* e, lval* a);
@@ -134,16 +674,23 @@ lval* builtin_if(lenv* e, lval* a);
 lval* builtin_load(lenv* e, lval* a);
 lval* builtin_print(lenv* e, lval* a);
 lval* builtin_error(lenv* e, lval* a);
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+lval* builtin_slice(lenv* e, lval* a);
 
 
 /* declare lval methods */
+lval* lval_new(int type);
+void lval_reserve(lval* v, int n);
 lval* lval_num(long x);
+lval* lval_dbl(double x);
+double ldbl(lval* x);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 lval* lval_fun(lbuiltin func);
-lval* lval_lambda(lval* formals, lval* body);
+lval* lval_lambda(lenv* e, lval* formals, lval* body);
 lval* lval_str(char* s);
 lval* lval_exit();
 lval* lval_read_num(mpc_ast_t* t);
@@ -154,23 +701,176 @@ lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 lval* lval_join(lval* x, lval* y);
 lval* lval_copy(lval* v);
-lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_unshare(lval* v);
+lval* lval_bind(lval* f, lval* a, lenv** frame);
 int lval_eq(lval* x, lval* y);
 void lval_del(lval* v);
+long lval_release(lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
 void lval_expr_print(lval* v, char open, char close);
 void lval_print_str(lval* v);
+void lval_print_dbl(double x);
+
+/* declare vector methods */
+lval* lvec_run(lval* base, int off, int n);
+lval* lvec_node(lval* l, lval* r);
+lval* lvec_from(lval* x);
+lval* lvec_cat(lval* a, lval* b);
+lval* lvec_slice(lval* v, int from, int n);
+lval* lvec_nth(lval* v, int i);
+void lvec_fill(lval* v, lval* x);
+void lvec_print(lval* v, int first);
+lval* lvec_flat(lval* v);
+lval* lvec_args(lbuiltin f, lval* a);
+
+/* declare big number methods */
+lbig* lbig_new(int n);
+lbig* lbig_copy(lbig* b);
+lbig* lbig_long(lbig* b, uint32_t* buf, long x);
+lbig* lbig_of(lval* x, lbig* b, uint32_t* buf);
+void lbig_trim(lbig* b);
+lval* lval_big(lbig* b);
+int lmag_cmp(uint32_t* a, int an, uint32_t* b, int bn);
+int lbig_cmp(lbig* a, lbig* b);
+void lmag_add_into(uint32_t* r, uint32_t* x, int xn);
+void lmag_sub_into(uint32_t* r, uint32_t* x, int xn);
+lbig* lbig_add(lbig* a, lbig* b, int sub);
+void lmag_mul(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn);
+lbig* lbig_mul(lbig* a, lbig* b);
+lbig* lbig_div(lbig* a, lbig* b, int mod);
+lbig* lbig_pow(lbig* a, unsigned long e);
+int lpow_long(long x, long e, long* r);
+lbig* lbig_read(char* s);
+void lbig_print(lbig* b);
+
+/* declare array methods */
+lval* lval_arr(int dbl, int n);
+lval* larr_as(lval* x, int dbl, int n);
+lval* larr_pair(char* func, lval** x, lval** y);
+double larr_combine_f(int op, double x, double y);
+int64_t larr_combine_i(int op, int64_t x, int64_t y);
+int larr_map(int op, larr* r, larr* a, larr* b, long n);
+void larr_ord(int op, int64_t* r, larr* a, larr* b, long n);
+lval* larr_fold(int op, larr* a, larr* b, long n);
+void larr_axpy(double* y, double a, double* x, long n);
+
+/* declare matrix methods */
+lval* lval_mat(int rows, int cols);
+void lmat_mul(lmat* c, lmat* a, lmat* b);
+void lmat_transpose(lmat* t, lmat* a);
 
 /*declare lenv methods */
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
 void lenv_add_builtins(lenv* e);
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
+long lenv_release(lenv* e);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
-lenv* lenv_copy(lenv* e);
+lenv* lenv_ref(lenv* e);
+lenv* lenv_frame(lenv* par, int n);
+void lenv_bind(lenv* e, char* sym, lval* v);
+void lenv_frame_del(lenv* e);
+int lenv_find(lenv* e, char* sym);
+void lenv_index(lenv* e, int slot);
+size_t lenv_hash(char* sym);
+
+/* declare bytecode compiler and vm methods */
+lcode* lcode_new(void);
+void lcode_del(lcode* c);
+void lcode_emit(lcode* c, int op);
+int lcode_const(lcode* c, lval* v);
+void lcode_compile(lcode* c, lscope* sc, lval* v, int tail);
+void lcode_compile_list(lcode* c, lscope* sc, lval* v, int tail);
+void lcode_compile_sym(lcode* c, lscope* sc, lval* v);
+void lscope_scan(lscope* sc, lval* v);
+int lscope_known(lscope* sc, lval* v);
+void lscope_push(lscope* sc, lval* v, int at);
+void lscope_pop(lscope* sc);
+int lscope_last(lscope* sc, char* sym);
+lcode* lval_code(lval* f, lenv* frame);
+void lcode_fresh(lval* f);
+void vm_push(lval* v);
+lval* vm_pop(void);
+void vm_push_frame(lcode* code, lenv* e, lval* fn);
+lval* vm_hidden(lenv* e, lenv* stop, char* sym);
+lval* vm_run(lenv* e, lcode* code);
+
+/* declare jit methods */
+lval* ljit_call(lval* f, lval* a);
+ljit* ljit_compile(lval* f);
+int ljit_guard(ljit* j, lval* f);
+void ljit_free(ljit* j);
+void lasm_bytes(lasm* s, char* b, int n);
+void lasm_imm32(lasm* s, int32_t x);
+void lasm_imm64(lasm* s, int64_t x);
+int lasm_jump(lasm* s, char* op, int n, int target);
+void lasm_patch(lasm* s, int at);
+int lasm_param(lasm* s, lval* x);
+int lasm_slot(lasm* s, int i);
+int lasm_global(lasm* s, lval* x);
+int lasm_func(lasm* s, lval* v);
+int lasm_expr(lasm* s, lval* x, int tail);
+int lasm_operand(lasm* s, lval* x);
+int lasm_list(lasm* s, lval* x, int tail);
+
+/* declare optimiser methods */
+lval* lopt_run(lenv* e, lval* x);
+void lopt_call(lopt_scope* sc, lval* p, int i, int code);
+void lopt_lambda(lopt_scope* sc, lval* x, lval* hidden);
+int lopt_scan(lval* v, lval** hidden);
+lval* lopt_global(lopt_scope* sc, lval* x);
+int lopt_hidden(lopt_scope* sc, char* sym);
+int lopt_inline(lopt_scope* sc, lval* p, int i, int code, lval* g);
+int lopt_movable(lopt_scope* sc, lval* g, lval* v, char* self, int data);
+int lopt_uses(lval* v, char* sym);
+int lopt_first(lval* v, char* sym);
+int lopt_before(lopt_scope* sc, lval* v, char* sym, int* stop);
+int lopt_quiet(lopt_scope* sc, lval* v);
+int lopt_calm(lopt_scope* sc, lval* g, lval** seen, int nseen);
+int lopt_calm_code(lopt_scope* sc, lval* g, lval* v,
+    lval** seen, int nseen);
+void lopt_rely(lopt_scope* sc);
+lval* lopt_subst(lval* v, lval* formals, lval* x);
+int lopt_pure(lbuiltin b, lval* x);
+int lopt_pure_fn(lbuiltin b);
+void lopt_replace(lval* p, int i, int code, lval* items);
+int lopt_nodes(lval* v);
+void lopt_save(lval* list);
+void lopt_fill(lval* list, lval* items);
+void lopt_depend(char* sym);
+void lopt_rebind(char* sym);
+void lopt_restore(void);
+
+/* declare heap and collector methods */
+void* lpool_alloc(lpool* p);
+void lpool_free(lpool* p, void* x);
+int lslab_class(int n);
+void* lslab_alloc(int n);
+void* lslab_resize(void* x, int from, int to);
+void lslab_free(void* x, int n);
+lenv* lenv_alloc(void);
+void lenv_young(lenv* e);
+void lval_free(lval* v);
+void lenv_free(lenv* e);
+void gc_init(void);
+void gc_safepoint(void);
+void gc_step(void);
+void gc_pause(clock_t start);
+void gc_collect(int major);
+void gc_candidate_val(lval* v);
+void gc_candidate_env(lenv* e);
+void gc_edges(lval* v, lenv* e, void (*visit)(lval*, lenv*));
+void gc_visit_unref(lval* v, lenv* e);
+void gc_visit_live(lval* v, lenv* e);
+void gc_visit_release(lval* v, lenv* e);
+
+/* declare symbol table methods */
+char* lsym_intern(char* s);
+unsigned long lsym_hash(char* s);
+void lsym_init(void);
 
 /* other methods */
 char* ltype_name(int t);
@@ -193,8 +893,8 @@ int main(int argc, char** argv) {
     /* define the language */
     mpca_lang(MPCA_LANG_DEFAULT,
         "                                                                           \
-            number      : /-?[0-9]+/ ;                                              \
-            symbol      : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                        \
+            number      : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ;                  \
+            symbol      : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%^]+/ ;                      \
             string      : /\"(\\\\.|[^\"])*\"/ ;                                    \
             comment     : /;[^\\r\\n]*/ ;                                           \
             sexpr       : '(' <expr>* ')' ;                                         \
@@ -205,21 +905,41 @@ int main(int argc, char** argv) {
         ",
         Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
+    /* pick up command line flags, everything else is a file to load */
+    int files = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tree") == 0) {
+            /* evaluate with the reference tree walker instead of the vm */
+            eval_mode = EVAL_TREE;
+        } else if (strcmp(argv[i], "--no-opt") == 0) {
+            /* run code exactly as it was written */
+            lopt.enabled = 0;
+        } else {
+            files++;
+        }
+    }
+
+    lsym_init();
+    gc_init();
+#ifdef LARR_SIMD
+    larr_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    
     /* Print version and exit info */
     puts("Lisperer Version 0.0.0.1");
     puts("exit() to quit \n");
     
     lenv* e = lenv_new();
+    lenv_root = e;
     lenv_add_builtins(e);
     
     /* load standard library */
     lval* libr = lval_add(lval_sexpr(), lval_str("stlib.lspy"));
     lval* res = builtin_load(e, libr);
-    if (res->type == LVAL_ERR) { lval_println(res); }
+    if (ltype(res) == LVAL_ERR) { lval_println(res); }
     lval_del(res);
-    lval_del(libr);
     
-    if(argc == 1) {
+    if(files == 0) {
     
         /* In a never ending loop */
         while(1) {
@@ -233,11 +953,11 @@ int main(int argc, char** argv) {
             mpc_result_t r;
             if (mpc_parse("<stdin>", input, Lispy, &r)) {
                 /*parse successful */
-                lval* x = lval_eval(e, lval_read(r.output));
+                lval* x = lval_exec(e, lopt_run(e, lval_read(r.output)));
                 
                 lval_println(x);
                 
-                if(x->type == LVAL_EXIT){
+                if(ltype(x) == LVAL_EXIT){
                     lval_del(x);
                     mpc_ast_delete(r.output);
                     free(input);
@@ -247,6 +967,9 @@ int main(int argc, char** argv) {
                 
                 mpc_ast_delete(r.output);
                 
+                /* finish freeing while waiting for the next input */
+                while(gc.ndead_vals || gc.ndead_envs) {gc_step();}
+                
                 
             } else {
                 /* Parse unsuccessful */
@@ -261,10 +984,12 @@ int main(int argc, char** argv) {
     }
     
     /* if supplied with a list of files */
-    if (argc >= 2) {
+    if (files > 0) {
   
         /* loop over each supplied filename (starting from 1) */
         for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--tree") == 0) { continue; }
+            if (strcmp(argv[i], "--no-opt") == 0) { continue; }
           
             /* Argument list with a single argument, the filename */
             lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
@@ -273,12 +998,13 @@ int main(int argc, char** argv) {
             lval* x = builtin_load(e, args);
           
             /* If the result is an error be sure to print it */
-            if (x->type == LVAL_ERR) { lval_println(x); }
+            if (ltype(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
         }
     }
     
     lenv_del(e);
+    while(gc.ndead_vals || gc.ndead_envs) {gc_step();}
     
     /* undefine and delete our parsers */
     mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
@@ -286,16 +1012,21 @@ int main(int argc, char** argv) {
     return 0;
 }
 
-/* evaluates an S-expression */
+/* evaluates the children of an S-expression */
+/* returns the result, or NULL if v is left holding a call to make */
+/* the children are replaced in place so v must not be shared */
 lval* lval_eval_sexpr(lenv* e, lval* v) {
     /*Evaluate Children */
+    /* a child being evaluated is taken out so the collector can't follow it */
     for(int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+        lval* x = v->cell[i];
+        v->cell[i] = NULL;
+        v->cell[i] = lval_eval(e, x);
     }
         
     /* error checking */
     for(int i = 0; i < v->count; i++) {
-        if(v->cell[i]->type == LVAL_ERR) {return lval_take(v, i);}
+        if(ltype(v->cell[i]) == LVAL_ERR) {return lval_take(v, i);}
     }
     
     /* Empty Expression */
@@ -305,772 +1036,4185 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     if(v->count == 1) {return lval_take(v, 0);}
     
     /* Ensure first element is a function after evaluation */
-    lval* f = lval_pop(v, 0);
-    if(f->type == LVAL_EXIT) {
-        lval_del(f);
+    lval* f = v->cell[0];
+    if(ltype(f) == LVAL_EXIT) {
         lval_del(v);
         return lval_exit();
     }
-    if(f->type != LVAL_FUN) {
+    if(ltype(f) != LVAL_FUN) {
         lval* err = lval_err(
             "S-Expression starts with incorrect type. "
             "Got %s, Expected %s.",
-            ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f); 
+            ltype_name(ltype(f)), ltype_name(LVAL_FUN));
         lval_del(v);
         return err;
     }
-    /* call the function to get the result */
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    return NULL;
 }
 
 lval* lval_eval(lenv* e, lval* v) {
-    if(v->type == LVAL_SYM) {
+    if(ltype(v) == LVAL_SYM) {
         lval* x = lenv_get(e, v);
         lval_del(v);
         return x;
     }
     
-    /* evaluate s-expressions */
-    if(v->type == LVAL_SEXPR) {return lval_eval_sexpr(e, v);}
+    /* function whose environment we are in after a tail call */
+    lval* owner = NULL;
+    
+    /* evaluate s-expressions, looping on calls in tail position */
+    while(ltype(v) == LVAL_SEXPR) {
+        gc_safepoint();
+        v = lval_unshare(v);
+        lval* x = lval_eval_sexpr(e, v);
+        if(x) {v = x; break;}
+        
+        lval* f = lval_pop(v, 0);
+        
+        /* evaluate the chosen branch of an if in this loop */
+        if(lval_builtin(f) == builtin_if && v->count == 3
+            && ltype(v->cell[0]) == LVAL_NUM
+            && ltype(v->cell[1]) == LVAL_QEXPR
+            && ltype(v->cell[2]) == LVAL_QEXPR) {
+            x = lval_unshare(lval_pop(v, lnum(v->cell[0]) ? 1 : 2));
+            x->type = LVAL_SEXPR;
+            lval_del(v); lval_del(f);
+            v = x;
+            continue;
+        }
+        
+        /* If Builtin then simply apply that */
+        if(lval_builtin(f)) {
+            if(lvec_live) {v = lvec_args(lval_builtin(f), v);}
+            v = lval_builtin(f)(e, v);
+            lval_del(f);
+            break;
+        }
+        
+        /* hot functions run as machine code where they can */
+        x = ljit_call(f, v);
+        if(x) {v = x; lval_del(f); break;}
+        
+        /* Bind the arguments in a new frame, unless some are missing */
+        lenv* frame;
+        x = lval_bind(f, v, &frame);
+        if(x) {v = x; lval_del(f); break;}
+        
+        /* Replace the function we are in, its frame is no longer needed */
+        if(owner) {lval_del(owner); lenv_frame_del(e);}
+        owner = f;
+        e = frame;
+        
+        /* Evaluate the body in place of the call */
+        v = lval_unshare(lval_copy(f->fn->body));
+        v->type = LVAL_SEXPR;
+    }
+    
+    if(owner) {lval_del(owner); lenv_frame_del(e);}
     /* all other lval types remain the same */
     return v;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+/* evaluates an lval with whichever evaluator is selected */
+lval* lval_exec(lenv* e, lval* v) {
+    if(eval_mode == EVAL_TREE) {return lval_eval(e, v);}
+    
+    /* only symbols and s-expressions need compiling */
+    if(ltype(v) != LVAL_SYM && ltype(v) != LVAL_SEXPR) {return v;}
+    
+    /* top level code has no known frames, symbols are looked up by name */
+    lcode* c = lcode_new();
+    lcode_compile(c, NULL, v, 1);
+    lcode_emit(c, OP_RET);
+    lval_del(v);
+    
+    lval* x = vm_run(e, c);
+    lcode_del(c);
+    return x;
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+/* construct a new, empty chunk of bytecode */
+lcode* lcode_new(void) {
+    lcode* c = malloc(sizeof(lcode));
+    c->refs = 1;
+    c->count = 0;
+    c->cap = 0;
+    c->ops = NULL;
+    c->nconsts = 0;
+    c->consts = NULL;
+    c->id = ++lcode_ids;
+    c->calls = 0;
+    c->jit = NULL;
+    c->epoch = lopt.epoch;
+    return c;
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
-        
-    /*first argument is symbol list */
-    lval* syms = a->cell[0];
-        
-    /* ensure all elements of first list are symbols */
-    for(int i = 0; i < syms->count; i++){
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-            "Function '%s' cannot define non-symbol. "
-            "Got %s, Expected %s.", func,
-            ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
-    }
-    /* check correct number of symbols and values */
-    LASSERT(a, (syms->count == a->count-1),
-        "Function '%s' passed too many arguments for symbols. "
-        "Got %i, Expected %i.", func, syms->count, a->count-1);
-        
-    /* assign copies of values to symbols */
-    for (int i = 0; i < syms->count; i++) {
-        /* If 'def' define in globally. If 'put' define in locally */
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i+1]);
-        }
-    
-        if (strcmp(func, "=")   == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i+1]);
-        } 
+/* drops a reference to a chunk, freeing it with the last one */
+void lcode_del(lcode* c) {
+    if(--c->refs > 0) {return;}
+    for(int i = 0; i < c->nconsts; i++) {
+        lval_del(c->consts[i]);
     }
-  
-    lval_del(a);
-    return lval_sexpr();
+    free(c->consts);
+    free(c->ops);
+    if(c->jit) {ljit_free(c->jit);}
+    free(c);
 }
 
-
-lval* builtin_op(lenv* e, lval* a, char* op) {
-  
-    /* Ensure all arguments are numbers */
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM);
-    }
-  
-    /* Pop the first element */
-    lval* x = lval_pop(a, 0);
-
-    /* If no arguments and sub then perform unary negation */
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
+/* appends an opcode or operand to a chunk */
+void lcode_emit(lcode* c, int op) {
+    if(c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
     }
+    c->ops[c->count++] = op;
+}
 
-    /* While there are still elements remaining */
-    while (a->count > 0) {
-
-        /* Pop the next element */
-        lval* y = lval_pop(a, 0);
-
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division By Zero!"); break;
-            }
-            x->num /= y->num;
-        }
-        if(strcmp(op, "%") == 0) {
-            if(y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division By Zero!"); break;
-            }
-            x->num %= y->num;
-        }
-        if(strcmp(op, "^") == 0) {
-            x->num = (long) pow(x->num, y->num);
-        }
+/* adds a constant to a chunk and returns its index - takes ownership */
+int lcode_const(lcode* c, lval* v) {
+    c->nconsts++;
+    c->consts = realloc(c->consts, sizeof(lval*) * c->nconsts);
+    c->consts[c->nconsts-1] = v;
+    return c->nconsts-1;
+}
 
-        lval_del(y);
+/* compiles code to evaluate a single lval */
+/* tail is set when the result is returned straight from the chunk */
+void lcode_compile(lcode* c, lscope* sc, lval* v, int tail) {
+    switch(ltype(v)) {
+        case LVAL_SYM:
+            lcode_compile_sym(c, sc, v);
+            break;
+        case LVAL_SEXPR:
+            lcode_compile_list(c, sc, v, tail);
+            break;
+        /* everything else evaluates to itself */
+        default:
+            lcode_emit(c, OP_CONST);
+            lcode_emit(c, lcode_const(c, lval_copy(v)));
+            break;
     }
-
-    lval_del(a); return x;
 }
 
-/* compares the order of numeric values (<, >, <=, >=) */
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
-    
-    int r;
-    if (strcmp(op, ">") == 0) {
-        r = (a->cell[0]->num > a->cell[1]->num);
+/* compiles code to evaluate the cells of v as an s-expression */
+void lcode_compile_list(lcode* c, lscope* sc, lval* v, int tail) {
+    /* Empty Expression */
+    if(v->count == 0) {
+        lcode_emit(c, OP_CONST);
+        lcode_emit(c, lcode_const(c, lval_sexpr()));
+        return;
     }
-    if (strcmp(op, "<")  == 0) {
-        r = (a->cell[0]->num <  a->cell[1]->num);
+    
+    /* Single expression */
+    if(v->count == 1) {
+        lcode_compile(c, sc, v->cell[0], tail);
+        return;
     }
-    if (strcmp(op, ">=") == 0) {
-        r = (a->cell[0]->num >= a->cell[1]->num);
+    
+    /* if with literal branches - branch inline when 'if' is the builtin */
+    if(v->count == 4 && ltype(v->cell[0]) == LVAL_SYM
+        && v->cell[0]->sym == sym_if
+        && ltype(v->cell[2]) == LVAL_QEXPR
+        && ltype(v->cell[3]) == LVAL_QEXPR) {
+        
+        lscope_push(sc, v, 1);
+        lcode_compile(c, sc, v->cell[0], 0);
+        lscope_pop(sc);
+        lscope_push(sc, v, 2);
+        lcode_compile(c, sc, v->cell[1], 0);
+        lscope_pop(sc);
+        lcode_emit(c, OP_IF);
+        int else_at = c->count; lcode_emit(c, 0);
+        int generic_at = c->count; lcode_emit(c, 0);
+        
+        lcode_compile_list(c, sc, v->cell[2], tail);
+        lcode_emit(c, OP_JUMP);
+        int then_end = c->count; lcode_emit(c, 0);
+        
+        c->ops[else_at] = c->count;
+        lcode_compile_list(c, sc, v->cell[3], tail);
+        lcode_emit(c, OP_JUMP);
+        int else_end = c->count; lcode_emit(c, 0);
+        
+        /* otherwise call whatever 'if' is bound to as normal */
+        c->ops[generic_at] = c->count;
+        lcode_compile(c, sc, v->cell[2], 0);
+        lcode_compile(c, sc, v->cell[3], 0);
+        lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+        lcode_emit(c, 4);
+        
+        c->ops[then_end] = c->count;
+        c->ops[else_end] = c->count;
+        return;
     }
-    if (strcmp(op, "<=") == 0) {
-        r = (a->cell[0]->num <= a->cell[1]->num);
+    
+    /* push the function and each argument then call */
+    for(int i = 0; i < v->count; i++) {
+        lscope_push(sc, v, i + 1);
+        lcode_compile(c, sc, v->cell[i], 0);
+        lscope_pop(sc);
     }
-    lval_del(a);
-    return lval_num(r);
+    lcode_emit(c, tail ? OP_TAILCALL : OP_CALL);
+    lcode_emit(c, v->count);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if(strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
+/* compiles a variable reference */
+/* names bound in an enclosing frame become a (depth, slot) load */
+void lcode_compile_sym(lcode* c, lscope* sc, lval* v) {
+    int k = lcode_const(c, lval_copy(v));
+    
+    /* nothing is known about the frames, or the name is bound with '=' */
+    int dynamic = (sc == NULL || sc->open);
+    for(int i = 0; !dynamic && i < sc->dyn->count; i++) {
+        if(sc->dyn->cell[i]->sym == v->sym) {dynamic = 1;}
     }
-    if(strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
+    if(dynamic) {
+        lcode_emit(c, OP_SYM);
+        lcode_emit(c, k);
+        return;
     }
-    lval_del(a);
-    return lval_num(r);
+    
+    /* search each enclosing frame in turn, stopping at the global one */
+    int depth = 0;
+    for(lenv* e = sc->env; e->par; e = e->par, depth++) {
+        int i = lenv_find(e, v->sym);
+        if(i >= 0 && depth == 0 && !sc->keep && lscope_last(sc, v->sym)) {
+            /* nothing reads the name again, so the value can be moved */
+            lcode_emit(c, OP_MOVE);
+            lcode_emit(c, i);
+            return;
+        }
+        if(i >= 0) {
+            lcode_emit(c, OP_LOCAL);
+            lcode_emit(c, depth);
+            lcode_emit(c, i);
+            return;
+        }
+    }
+    
+    /* followed by the cached version and slot, filled in when run */
+    lcode_emit(c, OP_GLOBAL);
+    lcode_emit(c, k);
+    lcode_emit(c, -1);
+    lcode_emit(c, 0);
 }
 
-/* returns the first element of a q-expression as a new q-expression */
-/* frees the rest */
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
-    lval* v = lval_take(a, 0);
-    while(v->count > 1) {lval_del(lval_pop(v, 1));}
-    return v;
+/* notes that the cells of v from at on run after what is compiled next */
+void lscope_push(lscope* sc, lval* v, int at) {
+    if(!sc) {return;}
+    if(sc->nlater < LSCOPE_DEPTH) {
+        sc->later[sc->nlater] = v;
+        sc->later_at[sc->nlater] = at;
+    }
+    sc->nlater++;
 }
 
-/* returns a q-expression with the first element removed */
-lval* builtin_tail(lenv* e, lval* a){
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
-        
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+void lscope_pop(lscope* sc) {
+    if(sc) {sc->nlater--;}
 }
 
-/* converts an s-expression into a q-expression */
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+/* checks that the code still to run doesn't mention a name anywhere, */
+/* even in a q-expression that may be evaluated or made a function */
+int lscope_last(lscope* sc, char* sym) {
+    if(sc->nlater > LSCOPE_DEPTH) {return 0;}
+    for(int k = 0; k < sc->nlater; k++) {
+        lval* v = sc->later[k];
+        for(int i = sc->later_at[k]; i < v->count; i++) {
+            if(lopt_uses(v->cell[i], sym)) {return 0;}
+        }
+    }
+    return 1;
 }
 
-/* converts a q-expression into an s-expression and evaluates it */
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+/* finds the names a function body binds locally with '=' */
+void lscope_scan(lscope* sc, lval* v) {
+    if(ltype(v) != LVAL_SEXPR && ltype(v) != LVAL_QEXPR) {return;}
     
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+    for(int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if(ltype(x) == LVAL_SYM && x->sym == sym_put) {
+            /* a literal list of names can be tracked, anything else can't */
+            lval* names = (i == 0 && v->count > 1) ? v->cell[1] : NULL;
+            if(names == NULL || ltype(names) != LVAL_QEXPR) {
+                sc->open = 1;
+                continue;
+            }
+            for(int j = 0; j < names->count; j++) {
+                if(ltype(names->cell[j]) != LVAL_SYM) {continue;}
+                sc->dyn = lval_add(sc->dyn, lval_copy(names->cell[j]));
+            }
+        }
+        
+        /* a function made here or code built as it runs sees the frame, */
+        /* and so may anything called that isn't known */
+        if(ltype(x) == LVAL_SYM && (x->sym == sym_lambda
+            || x->sym == sym_eval || x->sym == sym_load)) {sc->keep = 1;}
+        if(i == 0 && v->count > 1 && !lscope_known(sc, v)) {sc->keep = 1;}
+        lscope_scan(sc, x);
+    }
 }
 
-/* joins multiple q-expressions together */
-lval* builtin_join(lenv* e, lval* a) {
-    for(int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+/* checks the call v is to a global function that can't see the frame */
+/* of the body it is called from */
+int lscope_known(lscope* sc, lval* v) {
+    lval* x = v->cell[0];
+    if(ltype(x) != LVAL_SYM) {return 0;}
+    for(lenv* e = sc->env; e->par; e = e->par) {
+        if(lenv_find(e, x->sym) >= 0) {return 0;}
     }
+    int k = lenv_find(lenv_root, x->sym);
+    if(k < 0 || ltype(lenv_root->vals[k]) != LVAL_FUN) {return 0;}
     
-    lval* x = lval_pop(a, 0);
-    
-    while(a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    /* the builtins that run code, unless it is written out */
+    lbuiltin b = lval_builtin(lenv_root->vals[k]);
+    if(b == builtin_eval || b == builtin_load || b == builtin_lambda) {
+        return 0;
     }
-    
-    lval_del(a);
-    return x;
+    if(b == builtin_if) {
+        return v->count == 4 && ltype(v->cell[2]) == LVAL_QEXPR
+            && ltype(v->cell[3]) == LVAL_QEXPR;
+    }
+    return 1;
 }
 
-/* function for adding */
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+/* returns the compiled body of a user defined function */
+/* compiled on the first call, once the arguments are bound in its frame */
+lcode* lval_code(lval* f, lenv* frame) {
+    lcode_fresh(f);
+    if(f->fn->code->ops == NULL) {
+        lscope sc = { frame, lval_sexpr(), 0 };
+        lscope_scan(&sc, f->fn->body);
+        lcode_compile_list(f->fn->code, &sc, f->fn->body, 1);
+        lcode_emit(f->fn->code, OP_RET);
+        lval_del(sc.dyn);
+    }
+    return f->fn->code;
 }
 
-/* function for subtracting */
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+/* gives a function a new chunk if the optimiser has put back code since */
+/* it was compiled - frames still running the old chunk keep it */
+void lcode_fresh(lval* f) {
+    if(f->fn->code->epoch == lopt.epoch) {return;}
+    lcode_del(f->fn->code);
+    f->fn->code = lcode_new();
 }
 
-/* function for multiplying */
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+/* pushes a value on to the vm stack */
+void vm_push(lval* v) {
+    if(vm.sp == vm.stack_cap) {
+        vm.stack_cap = vm.stack_cap ? vm.stack_cap * 2 : 256;
+        vm.stack = realloc(vm.stack, sizeof(lval*) * vm.stack_cap);
+    }
+    vm.stack[vm.sp++] = v;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+/* pops a value off the vm stack */
+lval* vm_pop(void) {
+    return vm.stack[--vm.sp];
 }
 
-lval* builtin_exit(lenv* e, lval* a) {
-    return lval_exit();
+/* starts running a chunk in a new frame */
+void vm_push_frame(lcode* code, lenv* e, lval* fn) {
+    if(vm.nframes == vm.frames_cap) {
+        vm.frames_cap = vm.frames_cap ? vm.frames_cap * 2 : 64;
+        vm.frames = realloc(vm.frames, sizeof(lframe) * vm.frames_cap);
+    }
+    lframe* fr = &vm.frames[vm.nframes++];
+    fr->code = code;
+    code->refs++;
+    fr->pc = 0;
+    fr->env = e;
+    fr->fn = fn;
 }
 
-lval* builtin_lenv_print(lenv* e, lval* a) {
-    for(int i = 0; i < e->count; i++) {
-        printf("%s: ", e->syms[i]);
-        lval_println(e->vals[i]);
+/* finds a name given by '=' to one of the frames from e up to stop, */
+/* which compiled code looked past - returns NULL if none has it */
+lval* vm_hidden(lenv* e, lenv* stop, char* sym) {
+    for(; e != stop; e = e->par) {
+        if(!e->grown) {continue;}
+        int i = lenv_find(e, sym);
+        if(i >= 0) {return e->vals[i];}
+    }
+    return NULL;
+}
+
+/* runs a chunk to completion and returns its result */
+/* user defined function calls push frames rather than recursing in C */
+lval* vm_run(lenv* e, lcode* code) {
+    int base = vm.nframes;
+    vm_push_frame(code, e, NULL);
+    
+    while(vm.nframes > base) {
+        /* every reference is counted between instructions */
+        gc_safepoint();
+        
+        /* the frame stack may move during a call so re-fetch each step */
+        lframe* fr = &vm.frames[vm.nframes-1];
+        int* ops = fr->code->ops;
         
+        switch(ops[fr->pc++]) {
+            case OP_CONST:
+                vm_push(lval_copy(fr->code->consts[ops[fr->pc++]]));
+                break;
+                
+            case OP_SYM:
+                vm_push(lenv_get(fr->env, fr->code->consts[ops[fr->pc++]]));
+                break;
+                
+            case OP_LOCAL: {
+                lenv* e = fr->env;
+                for(int d = ops[fr->pc++]; d > 0; d--) {e = e->par;}
+                lval* x = e->vals[ops[fr->pc++]];
+                if(lenv_grown) {
+                    lval* y = vm_hidden(fr->env, e, e->syms[ops[fr->pc-1]]);
+                    if(y) {x = y;}
+                }
+                vm_push(lval_copy(x));
+                break;
+            }
+            
+            case OP_MOVE: {
+                /* the last read of a local takes its value out of the */
+                /* frame, so a list passed on isn't shared and needn't be */
+                /* copied to change - unless a closure can still see it */
+                lenv* e = fr->env;
+                int i = ops[fr->pc++];
+                if(e->refs == 1) {
+                    vm_push(e->vals[i]);
+                    e->vals[i] = lval_sexpr();
+                } else {
+                    vm_push(lval_copy(e->vals[i]));
+                }
+                break;
+            }
+            
+            case OP_GLOBAL: {
+                int* site = &ops[fr->pc];
+                fr->pc += 3;
+                if(lenv_grown) {
+                    lval* k = fr->code->consts[site[0]];
+                    lval* y = vm_hidden(fr->env, lenv_root, k->sym);
+                    if(y) {vm_push(lval_copy(y)); break;}
+                }
+                if((unsigned)site[1] != lenv_version) {
+                    lval* k = fr->code->consts[site[0]];
+                    int i = lenv_find(lenv_root, k->sym);
+                    if(i < 0) {
+                        vm_push(lval_err("Unbound Symbol '%s'", k->sym));
+                        break;
+                    }
+                    site[1] = lenv_version;
+                    site[2] = i;
+                }
+                vm_push(lval_copy(lenv_root->vals[site[2]]));
+                break;
+            }
+            
+            case OP_JUMP:
+                fr->pc = ops[fr->pc];
+                break;
+                
+            case OP_IF: {
+                lval* cond = vm.stack[vm.sp-1];
+                lval* f = vm.stack[vm.sp-2];
+                if(ltype(f) == LVAL_FUN && lval_builtin(f) == builtin_if
+                    && ltype(cond) == LVAL_NUM) {
+                    int taken = lnum(cond) != 0;
+                    lval_del(vm_pop());
+                    lval_del(vm_pop());
+                    fr->pc = taken ? fr->pc + 2 : ops[fr->pc];
+                } else {
+                    fr->pc = ops[fr->pc + 1];
+                }
+                break;
+            }
+            
+            case OP_CALL:
+            case OP_TAILCALL: {
+                int tail = ops[fr->pc-1] == OP_TAILCALL;
+                int n = ops[fr->pc++];
+                lenv* env = fr->env;
+                
+                /* gather the function and arguments into an s-expression */
+                lval* a = lval_new(LVAL_SEXPR);
+                lval_reserve(a, n);
+                a->count = n;
+                vm.sp -= n;
+                memcpy(a->cell, &vm.stack[vm.sp], sizeof(lval*) * n);
+                
+                /* error checking */
+                int err = -1;
+                for(int i = 0; i < n; i++) {
+                    if(ltype(a->cell[i]) == LVAL_ERR) {err = i; break;}
+                }
+                if(err >= 0) {vm_push(lval_take(a, err)); break;}
+                
+                lval* f = lval_pop(a, 0);
+                if(ltype(f) == LVAL_EXIT) {
+                    lval_del(f);
+                    lval_del(a);
+                    vm_push(lval_exit());
+                    break;
+                }
+                if(ltype(f) != LVAL_FUN) {
+                    vm_push(lval_err(
+                        "S-Expression starts with incorrect type. "
+                        "Got %s, Expected %s.",
+                        ltype_name(ltype(f)), ltype_name(LVAL_FUN)));
+                    lval_del(f);
+                    lval_del(a);
+                    break;
+                }
+                
+                /* builtins are simply applied */
+                if(lval_builtin(f)) {
+                    if(lvec_live) {a = lvec_args(lval_builtin(f), a);}
+                    vm_push(lval_builtin(f)(env, a));
+                    lval_del(f);
+                    break;
+                }
+                
+                /* hot functions run as machine code where they can */
+                lval* r = ljit_call(f, a);
+                if(r) {
+                    lval_del(f);
+                    vm_push(r);
+                    break;
+                }
+                
+                /* an error or a partial application is the result */
+                lenv* frame;
+                r = lval_bind(f, a, &frame);
+                if(r) {
+                    lval_del(f);
+                    vm_push(r);
+                } else if(tail) {
+                    /* reuse this frame, the function it ran is finished */
+                    lcode* code = lval_code(f, frame);
+                    code->refs++;
+                    lcode_del(fr->code);
+                    if(fr->fn) {lval_del(fr->fn); lenv_frame_del(fr->env);}
+                    fr->code = code;
+                    fr->pc = 0;
+                    fr->env = frame;
+                    fr->fn = f;
+                } else {
+                    /* run the body in a new frame owning the function */
+                    vm_push_frame(lval_code(f, frame), frame, f);
+                }
+                break;
+            }
+            
+            case OP_RET:
+                /* the result stays on the stack for the caller */
+                if(fr->fn) {lval_del(fr->fn); lenv_frame_del(fr->env);}
+                lcode_del(fr->code);
+                vm.nframes--;
+                break;
+        }
     }
-    lval_del(a);
-    return lval_sexpr();
+    
+    return vm_pop();
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    /* Check Two arguments, each of which are Q-Expressions */
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+/* the jit compiles the bodies of hot functions to x86-64 machine code */
+/* it handles whole number arithmetic, comparisons, if and calls to the */
+/* function itself - any other body is left to the interpreter */
+/* values are plain 64 bit integers, kept in rax with arguments and */
+/* partial results on the machine stack, and anything the code can't */
+/* finish (overflow, division by zero, a deep stack) bails out of the */
+/* whole call, which has no side effects, so the interpreter redoes it */
+
+/* how far below the entry point the machine code may use the stack */
+#define LJIT_STACK (1 << 20)
+#define LJIT_MAX_PARAMS 16
+
+/* a function whose machine code bails out this often is left to the */
+/* interpreter - each call the interpreter redoes after a bail can bail */
+/* again, so a deep recursion would otherwise be redone at every level */
+#define LJIT_MAX_BAILS 8
+
+/* templates for if and calls to user defined functions, next to the */
+/* builtin ops */
+enum { LJIT_IF = LOP_NE + 1, LJIT_CALL };
+
+/* the builtins the jit has templates for */
+struct { lbuiltin f; int op; } ljit_ops[] = {
+    { builtin_add, LOP_ADD }, { builtin_sub, LOP_SUB },
+    { builtin_mul, LOP_MUL }, { builtin_div, LOP_DIV },
+    { builtin_mod, LOP_MOD }, { builtin_gt, LOP_GT },
+    { builtin_lt, LOP_LT }, { builtin_ge, LOP_GE },
+    { builtin_le, LOP_LE }, { builtin_eq, LOP_EQ },
+    { builtin_ne, LOP_NE }, { builtin_if, LJIT_IF },
+};
+
+/* the setcc opcode for each comparison, after cmp rax, rcx */
+unsigned char ljit_setcc[] = {
+    [LOP_GT] = 0x9f, [LOP_LT] = 0x9c, [LOP_GE] = 0x9d,
+    [LOP_LE] = 0x9e, [LOP_EQ] = 0x94, [LOP_NE] = 0x95 };
+
+/* the result of running machine code, returned in rax and rdx */
+typedef struct {
+    long val;
+    long bail;
+} ljit_ret;
+
+typedef ljit_ret (*ljit_entry)(long* args);
+
+/* runs a function as machine code if it is hot enough and can be */
+/* returns NULL to have the interpreter make the call, otherwise the */
+/* arguments are consumed and the result returned */
+lval* ljit_call(lval* f, lval* a) {
+#ifdef LJIT
+    lcode_fresh(f);
+    lcode* c = f->fn->code;
+    if(c->calls < 0 || jit_threshold == 0) {return NULL;}
     
-    /* Check first Q-Expression contains only Symbols */
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-            "Cannot define non-symbol. Got %s, Expected %s.",
-            ltype_name(a->cell[0]->cell[i]->type),ltype_name(LVAL_SYM));
+    /* only whole functions, not partial applications, are compiled */
+    if(f->fn->args) {return NULL;}
+    if(!c->jit) {
+        if(++c->calls < jit_threshold) {return NULL;}
+        c->jit = ljit_compile(f);
+        if(!c->jit) {c->calls = -1; return NULL;}
     }
     
-    /* Pop first two arguments and pass them to lval_lambda */
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
+    ljit* j = c->jit;
+    if(a->count != j->nparams) {return NULL;}
+    long args[LJIT_MAX_PARAMS];
+    for(int i = 0; i < a->count; i++) {
+        if(ltype(a->cell[i]) != LVAL_NUM) {return NULL;}
+        args[i] = lnum(a->cell[i]);
+    }
+    if(!ljit_guard(j, f)) {return NULL;}
     
-    return lval_lambda(formals, body);
+    ljit_ret r = ((ljit_entry)j->mem)(args);
+    if(r.bail) {
+        if(++j->bails == LJIT_MAX_BAILS) {
+            ljit_free(j);
+            c->jit = NULL;
+            c->calls = -1;
+        }
+        return NULL;
+    }
+    lval_del(a);
+    return lval_num(r.val);
+#else
+    return NULL;
+#endif
+}
+
+/* checks the names the machine code called still mean the same thing */
+int ljit_guard(ljit* j, lval* f) {
+    /* the frames between the function and the globals mustn't hide them */
+    for(lenv* e = f->fn->env; e != lenv_root; e = e->par) {
+        if(!e) {return 0;}
+        for(int g = 0; g < j->nguards; g++) {
+            if(lenv_find(e, j->guards[g]) >= 0) {return 0;}
+        }
+    }
     
+    /* the globals themselves only need checking after a def */
+    if(j->version == lenv_version) {return 1;}
+    for(int g = 0; g < j->nguards; g++) {
+        int i = lenv_find(lenv_root, j->guards[g]);
+        if(i < 0) {return 0;}
+        lval* v = lenv_root->vals[i];
+        if(j->expect[g]) {
+            if(v != j->expect[g]) {return 0;}
+        } else if(ltype(v) != LVAL_FUN || lval_builtin(v) || v->fn->args
+            || v->fn->code->id != j->ids[g]) {
+            return 0;
+        }
+    }
+    j->version = lenv_version;
+    return 1;
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+/* appends machine code */
+void lasm_bytes(lasm* s, char* b, int n) {
+    if(s->n + n > s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->b = realloc(s->b, s->cap);
+    }
+    memcpy(s->b + s->n, b, n);
+    s->n += n;
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+void lasm_imm32(lasm* s, int32_t x) {
+    lasm_bytes(s, (char*)&x, 4);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+void lasm_imm64(lasm* s, int64_t x) {
+    lasm_bytes(s, (char*)&x, 8);
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+/* emits a jump or call to target, returning where its offset is so */
+/* that a forward jump can be patched once its target is known */
+int lasm_jump(lasm* s, char* op, int n, int target) {
+    lasm_bytes(s, op, n);
+    int at = s->n;
+    lasm_imm32(s, target - (at + 4));
+    return at;
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+/* points a forward jump at the end of the code so far */
+void lasm_patch(lasm* s, int at) {
+    int32_t rel = s->n - (at + 4);
+    memcpy(s->b + at, &rel, 4);
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+/* the parameter a symbol names, or -1 */
+int lasm_param(lasm* s, lval* x) {
+    if(ltype(x) != LVAL_SYM) {return -1;}
+    /* a repeated name is bound to the last argument given for it */
+    for(int i = s->nparams - 1; i >= 0; i--) {
+        if(s->formals->cell[i]->sym == x->sym) {return i;}
+    }
+    return -1;
 }
 
-/* function for if statements */
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+/* where parameter i is, relative to rbp - they are pushed in order */
+int lasm_slot(lasm* s, int i) {
+    return 16 + 8 * (s->nparams - 1 - i);
+}
+
+/* the template a global function call uses, or -1 if there isn't one */
+/* the binding is noted so the code can be checked before each run */
+int lasm_global(lasm* s, lval* x) {
+    int i = lenv_find(lenv_root, x->sym);
+    if(i < 0) {return -1;}
+    lval* v = lenv_root->vals[i];
     
-    /* Mark both expressions as evaluable (s-expressions) */
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    int op = -1;
+    lval* expect = v;
+    unsigned long id = 0;
+    if(lval_builtin(v)) {
+        int n = sizeof(ljit_ops) / sizeof(ljit_ops[0]);
+        for(int k = 0; k < n; k++) {
+            if(ljit_ops[k].f == lval_builtin(v)) {op = ljit_ops[k].op;}
+        }
+    } else if(ltype(v) == LVAL_FUN && !v->fn->args) {
+        /* a partial application shares the code but not the arguments */
+        s->callee = lasm_func(s, v);
+        if(s->callee < 0) {return -1;}
+        op = LJIT_CALL;
+        expect = NULL;
+        id = v->fn->code->id;
+    }
+    if(op < 0) {return -1;}
     
-    if(a->cell[0]->num) {
-        /* if condition is true, evaluate first expression */
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        /* if false, evaluate second expression */
-        x = lval_eval(e, lval_pop(a, 2));
+    for(int g = 0; g < s->nguards; g++) {
+        if(s->guards[g] == x->sym) {return op;}
+    }
+    s->nguards++;
+    s->guards = realloc(s->guards, sizeof(char*) * s->nguards);
+    s->expect = realloc(s->expect, sizeof(lval*) * s->nguards);
+    s->ids = realloc(s->ids, sizeof(unsigned long) * s->nguards);
+    s->guards[s->nguards-1] = x->sym;
+    s->expect[s->nguards-1] = expect;
+    s->ids[s->nguards-1] = id;
+    return op;
+}
+
+/* the index of a function compiled into the code, added if it isn't */
+/* yet - returns -1 if it can't be, as the names it closes over or the */
+/* arguments it takes aren't known */
+int lasm_func(lasm* s, lval* v) {
+    lcode_fresh(v);
+    for(int k = 0; k < s->nfuncs; k++) {
+        if(s->funcs[k]->fn->code == v->fn->code) {return k;}
     }
+    if(s->nfuncs == LJIT_MAX_FUNCS || v->fn->env != lenv_root) {return -1;}
     
-    /* Delete argument list and return */
-    lval_del(a);
-    return x;
+    lval* formals = v->fn->formals;
+    if(formals->count == 0 || formals->count > LJIT_MAX_PARAMS) {return -1;}
+    for(int i = 0; i < formals->count; i++) {
+        if(formals->cell[i]->sym == sym_amp) {return -1;}
+    }
+    s->funcs[s->nfuncs] = v;
+    return s->nfuncs++;
 }
 
-/* loads and evaluates an external file */
-lval* builtin_load(lenv* e, lval* a){
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
+/* compiles an expression leaving its value in rax, 0 if unsupported */
+int lasm_expr(lasm* s, lval* x, int tail) {
+    int i;
+    switch(ltype(x)) {
+        case LVAL_NUM:
+            lasm_bytes(s, "\x48\xb8", 2);           /* mov rax, imm64 */
+            lasm_imm64(s, lnum(x));
+            return 1;
+        case LVAL_SYM:
+            if((i = lasm_param(s, x)) < 0) {return 0;}
+            lasm_bytes(s, "\x48\x8b\x85", 3);       /* mov rax, [rbp+slot] */
+            lasm_imm32(s, lasm_slot(s, i));
+            return 1;
+        case LVAL_SEXPR:
+            return lasm_list(s, x, tail);
+    }
+    return 0;
+}
+
+/* compiles an operand into rcx, keeping rax */
+int lasm_operand(lasm* s, lval* x) {
+    int i;
+    if(ltype(x) == LVAL_NUM) {
+        lasm_bytes(s, "\x48\xb9", 2);               /* mov rcx, imm64 */
+        lasm_imm64(s, lnum(x));
+        return 1;
+    }
+    if((i = lasm_param(s, x)) >= 0) {
+        lasm_bytes(s, "\x48\x8b\x8d", 3);           /* mov rcx, [rbp+slot] */
+        lasm_imm32(s, lasm_slot(s, i));
+        return 1;
+    }
+    lasm_bytes(s, "\x50", 1);                       /* push rax */
+    if(!lasm_expr(s, x, 0)) {return 0;}
+    lasm_bytes(s, "\x48\x89\xc1\x58", 4);           /* mov rcx, rax; pop rax */
+    return 1;
+}
+
+/* compiles a list evaluated as an s-expression - a call or one value */
+int lasm_list(lasm* s, lval* x, int tail) {
+    if(x->count == 1) {return lasm_expr(s, x->cell[0], tail);}
+    if(x->count == 0 || ltype(x->cell[0]) != LVAL_SYM
+        || lasm_param(s, x->cell[0]) >= 0) {
+        return 0;
+    }
+    int op = lasm_global(s, x->cell[0]);
+    int n = x->count - 1;
+    lval** c = x->cell + 1;
     
-    /* parse file given by string name */
-    mpc_result_t r;
-    if(mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        /* read contents */
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    switch(op) {
+        case LJIT_IF: {
+            if(n != 3 || ltype(c[1]) != LVAL_QEXPR
+                || ltype(c[2]) != LVAL_QEXPR) {
+                return 0;
+            }
+            if(!lasm_expr(s, c[0], 0)) {return 0;}
+            lasm_bytes(s, "\x48\x85\xc0", 3);       /* test rax, rax */
+            int skip = lasm_jump(s, "\x0f\x84", 2, 0);  /* jz else */
+            if(!lasm_list(s, c[1], tail)) {return 0;}
+            int end = lasm_jump(s, "\xe9", 1, 0);   /* jmp end */
+            lasm_patch(s, skip);
+            if(!lasm_list(s, c[2], tail)) {return 0;}
+            lasm_patch(s, end);
+            return 1;
+        }
         
-        /* evaluate each expression */
-        while(expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            /* if evaluation leads to error print it */
-            if(x->type == LVAL_ERR) {
-                lval_println(x);
+        case LJIT_CALL: {
+            int k = s->callee;
+            if(n != s->funcs[k]->fn->formals->count) {return 0;}
+            for(int i = 0; i < n; i++) {
+                if(!lasm_expr(s, c[i], 0)) {return 0;}
+                lasm_bytes(s, "\x50", 1);           /* push rax */
             }
-            lval_del(x);
+            if(tail && k == s->cur) {
+                /* overwrite our own arguments and start again */
+                for(int i = n - 1; i >= 0; i--) {
+                    lasm_bytes(s, "\x58\x48\x89\x85", 4); /* pop rax; */
+                    lasm_imm32(s, lasm_slot(s, i)); /* mov [rbp+slot], rax */
+                }
+                lasm_jump(s, "\xe9", 1, s->body);   /* jmp body */
+            } else {
+                /* the function may not be compiled yet, so is filled in */
+                s->ncalls++;
+                s->calls = realloc(s->calls, sizeof(int) * s->ncalls);
+                s->calls_to = realloc(s->calls_to, sizeof(int) * s->ncalls);
+                s->calls[s->ncalls-1] = lasm_jump(s, "\xe8", 1, 0);
+                s->calls_to[s->ncalls-1] = k;       /* call func */
+                lasm_bytes(s, "\x48\x81\xc4", 3);   /* add rsp, 8n */
+                lasm_imm32(s, 8 * n);
+            }
+            return 1;
         }
-        /* delete expressions and arguments */
-        lval_del(expr);
-        lval_del(a);
-        /* return empty list */
-        return lval_sexpr();
-    } else {
-        /* get parse error as string */
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
         
-        /* create new error message using it */
-        lval* err = lval_err("Could not load Library %s", err_msg);
+        case LOP_ADD: case LOP_SUB: case LOP_MUL:
+        case LOP_DIV: case LOP_MOD:
+            if(!lasm_expr(s, c[0], 0)) {return 0;}
+            if(n == 1 && op == LOP_SUB) {
+                lasm_bytes(s, "\x48\xf7\xd8", 3);   /* neg rax */
+                lasm_jump(s, "\x0f\x80", 2, s->bail); /* jo bail */
+            }
+            for(int i = 1; i < n; i++) {
+                if(!lasm_operand(s, c[i])) {return 0;}
+                switch(op) {
+                    case LOP_ADD: lasm_bytes(s, "\x48\x01\xc8", 3); break;
+                    case LOP_SUB: lasm_bytes(s, "\x48\x29\xc8", 3); break;
+                    case LOP_MUL: lasm_bytes(s, "\x48\x0f\xaf\xc1", 4); break;
+                    default:
+                        /* dividing by zero or -1 is left to the interpreter */
+                        lasm_bytes(s, "\x48\x85\xc9", 3);   /* test rcx, rcx */
+                        lasm_jump(s, "\x0f\x84", 2, s->bail);
+                        lasm_bytes(s, "\x48\x83\xf9\xff", 4); /* cmp rcx, -1 */
+                        lasm_jump(s, "\x0f\x84", 2, s->bail);
+                        lasm_bytes(s, "\x48\x99\x48\xf7\xf9", 5); /* idiv rcx */
+                        if(op == LOP_MOD) {
+                            lasm_bytes(s, "\x48\x89\xd0", 3); /* mov rax, rdx */
+                        }
+                        continue;
+                }
+                lasm_jump(s, "\x0f\x80", 2, s->bail); /* jo bail */
+            }
+            return 1;
         
-        /* clean up and return error */
-        free(err_msg);
-        lval_del(a);
-        return err;
+        case LOP_GT: case LOP_LT: case LOP_GE:
+        case LOP_LE: case LOP_EQ: case LOP_NE:
+            if(n != 2) {return 0;}
+            if(!lasm_expr(s, c[0], 0) || !lasm_operand(s, c[1])) {return 0;}
+            lasm_bytes(s, "\x48\x39\xc8\x0f", 4);   /* cmp rax, rcx */
+            lasm_bytes(s, (char*)&ljit_setcc[op], 1); /* setcc al */
+            lasm_bytes(s, "\xc0\x0f\xb6\xc0", 4);   /* movzx eax, al */
+            return 1;
+    }
+    return 0;
+}
+
+/* compiles a function to machine code, or returns NULL if it can't be */
+ljit* ljit_compile(lval* f) {
+    lval* formals = f->fn->formals;
+    int n = formals->count;
+    if(n == 0 || n > LJIT_MAX_PARAMS) {return NULL;}
+    for(int i = 0; i < n; i++) {
+        if(formals->cell[i]->sym == sym_amp) {return NULL;}
+    }
+    
+    lasm s = { .nfuncs = 1 };
+    s.funcs[0] = f;
+    
+    /* entry - save registers, push the arguments and call the function */
+    /* r14 holds the stack to bail back to, r13 the lowest it may go */
+    lasm_bytes(&s, "\x55\x41\x55\x41\x56", 5);      /* push rbp, r13, r14 */
+    lasm_bytes(&s, "\x49\x89\xe6", 3);              /* mov r14, rsp */
+    lasm_bytes(&s, "\x4c\x8d\xac\x24", 4);          /* lea r13, [rsp-stack] */
+    lasm_imm32(&s, -LJIT_STACK);
+    for(int i = 0; i < n; i++) {
+        lasm_bytes(&s, "\xff\xb7", 2);              /* push [rdi+8i] */
+        lasm_imm32(&s, 8 * i);
+    }
+    int call = lasm_jump(&s, "\xe8", 1, 0);         /* call func */
+    lasm_bytes(&s, "\x31\xd2", 2);                  /* xor edx, edx */
+    int ret = s.n;
+    lasm_bytes(&s, "\x4c\x89\xf4", 3);              /* mov rsp, r14 */
+    lasm_bytes(&s, "\x41\x5e\x41\x5d\x5d\xc3", 6);  /* pop r14, r13, rbp; ret */
+    
+    /* bail out of every frame at once, flagging the result in rdx */
+    s.bail = s.n;
+    lasm_bytes(&s, "\xba\x01\x00\x00\x00", 5);      /* mov edx, 1 */
+    lasm_jump(&s, "\xe9", 1, ret);                  /* jmp ret */
+    
+    /* the functions, the one called first and then any it calls - */
+    /* arguments are above the return address */
+    lasm_patch(&s, call);
+    int ok = 1;
+    for(s.cur = 0; ok && s.cur < s.nfuncs; s.cur++) {
+        s.formals = s.funcs[s.cur]->fn->formals;
+        s.nparams = s.formals->count;
+        s.starts[s.cur] = s.n;
+        lasm_bytes(&s, "\x55\x48\x89\xe5", 4);      /* push rbp; mov rbp, rsp */
+        lasm_bytes(&s, "\x4c\x39\xec", 3);          /* cmp rsp, r13 */
+        lasm_jump(&s, "\x0f\x82", 2, s.bail);       /* jb bail */
+        s.body = s.n;
+        ok = lasm_list(&s, s.funcs[s.cur]->fn->body, 1);
+        lasm_bytes(&s, "\xc9\xc3", 2);              /* leave; ret */
+    }
+    for(int i = 0; ok && i < s.ncalls; i++) {
+        int32_t rel = s.starts[s.calls_to[i]] - (s.calls[i] + 4);
+        memcpy(s.b + s.calls[i], &rel, 4);
+    }
+    
+    ljit* j = NULL;
+#ifdef LJIT
+    /* copy it into memory that can be run but not written */
+    void* mem = MAP_FAILED;
+    if(ok) {
+        mem = mmap(NULL, s.n, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(mem != MAP_FAILED) {
+        memcpy(mem, s.b, s.n);
+        /* some systems refuse to run memory that was written */
+        if(mprotect(mem, s.n, PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, s.n);
+            mem = MAP_FAILED;
+        }
+    }
+    if(mem != MAP_FAILED) {
+        j = malloc(sizeof(ljit));
+        j->mem = mem;
+        j->size = s.n;
+        j->nparams = n;
+        j->bails = 0;
+        j->nguards = s.nguards;
+        j->guards = s.guards;
+        j->expect = s.expect;
+        j->ids = s.ids;
+        j->version = lenv_version;
+        s.guards = NULL;
+        s.expect = NULL;
+        s.ids = NULL;
+    }
+#else
+    (void)ok;
+#endif
+    free(s.b);
+    free(s.guards);
+    free(s.expect);
+    free(s.ids);
+    free(s.calls);
+    free(s.calls_to);
+    return j;
+}
+
+/* frees a function's machine code */
+void ljit_free(ljit* j) {
+#ifdef LJIT
+    munmap(j->mem, j->size);
+#endif
+    free(j->guards);
+    free(j->expect);
+    free(j->ids);
+    free(j);
+}
+
+/* the builtins that always give the same result for the same arguments */
+lbuiltin lopt_pures[] = {
+    builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod,
+    builtin_pow, builtin_sqrt, builtin_exp, builtin_log, builtin_sin,
+    builtin_cos, builtin_floor, builtin_gt, builtin_lt, builtin_ge,
+    builtin_le, builtin_eq, builtin_ne,
+};
+
+/* optimises code that has just been read, before it is run in e */
+lval* lopt_run(lenv* e, lval* x) {
+    /* code loaded inside a function may use that function's names */
+    if(!lopt.enabled || e != lenv_root || ltype(x) != LVAL_SEXPR) {return x;}
+    
+    /* only function bodies are changed, so x itself stays where it is */
+    lopt_scope sc = { lval_sexpr(), 0, 0, 0, lval_sexpr() };
+    lval* p = lval_add(lval_sexpr(), x);
+    lopt_call(&sc, p, 0, 0);
+    lval_del(sc.hidden);
+    lval_del(sc.calm);
+    return lval_take(p, 0);
+}
+
+/* optimises the call p->cell[i], an s-expression, or if code is set a */
+/* function body or branch of an if, written as a q-expression */
+void lopt_call(lopt_scope* sc, lval* p, int i, int code) {
+    lval* x = p->cell[i];
+    lval* g = x->count ? lopt_global(sc, x->cell[0]) : NULL;
+    lbuiltin b = g ? lval_builtin(g) : NULL;
+    int called = sc->called;
+    
+    /* the body of a new function is code, its formals are left alone */
+    int lambda = x->count == 3 && b == builtin_lambda;
+    int fun = x->count == 3 && b == builtin_fun;
+    if((lambda || fun) && ltype(x->cell[1]) == LVAL_QEXPR
+        && ltype(x->cell[2]) == LVAL_QEXPR) {
+        lopt_depend(x->cell[0]->sym);
+        lopt_lambda(sc, x, lval_copy(x->cell[1]));
+        /* fun defines a global when it is called */
+        if(fun) {sc->called = 1;}
+        return;
+    }
+    
+    /* the branches of an if are code, other q-expressions are data */
+    int branches = b == builtin_if && x->count == 4
+        && ltype(x->cell[2]) == LVAL_QEXPR
+        && ltype(x->cell[3]) == LVAL_QEXPR;
+    int after_cond = 0, after_then = 0;
+    for(int j = 0; j < x->count; j++) {
+        if(ltype(x->cell[j]) == LVAL_SEXPR) {
+            lopt_call(sc, x, j, 0);
+        } else if(branches && j >= 2) {
+            /* only one branch runs, straight after the condition */
+            if(j == 2) {after_cond = sc->called;}
+            if(j == 3) {after_then = sc->called; sc->called = after_cond;}
+            lopt_call(sc, x, j, 1);
+        }
+    }
+    sc->called |= after_then;
+    
+    /* a call that may redefine a global puts back the code as it was */
+    /* read - but this body has already started, so its changes after */
+    /* the call must not be needed */
+    int stale = sc->called;
+    if(x->count > 1) {
+        if(b == builtin_if ? !branches : !lopt_calm(sc, g, NULL, 0)) {
+            sc->called = 1;
+        } else if(g && !b) {
+            sc->calm = lval_add(sc->calm, lval_copy(x->cell[0]));
+        }
+    }
+    if(!sc->fold || stale) {return;}
+    
+    /* a call to a small function becomes its body, which may then fold */
+    if(g && !b && !sc->inlined && lopt_inline(sc, p, i, code, g)) {
+        /* what it calls is worked out again from the body */
+        sc->called = called;
+        if(code || ltype(p->cell[i]) == LVAL_SEXPR) {
+            sc->inlined = 1;
+            lopt_call(sc, p, i, code);
+            sc->inlined = 0;
+        }
+        return;
+    }
+    
+    /* an if on a literal condition becomes the branch it takes */
+    if(branches && ltype(x->cell[1]) == LVAL_NUM) {
+        lopt_depend(x->cell[0]->sym);
+        lopt_rely(sc);
+        lopt.prunes++;
+        lopt_replace(p, i, code,
+            lval_copy(x->cell[lnum(x->cell[1]) ? 2 : 3]));
+        return;
+    }
+    
+    /* a pure builtin on literal numbers becomes its result */
+    if(!lopt_pure(b, x)) {return;}
+    lval* a = lval_sexpr();
+    for(int j = 1; j < x->count; j++) {
+        a = lval_add(a, lval_copy(x->cell[j]));
+    }
+    lval* r = b(lenv_root, a);
+    
+    /* errors are left to happen if the code is run */
+    if(ltype(r) == LVAL_ERR) {lval_del(r); return;}
+    lopt_depend(x->cell[0]->sym);
+    lopt_rely(sc);
+    lopt.folds++;
+    lopt_replace(p, i, code, lval_add(lval_sexpr(), r));
+}
+
+/* optimises the body of the function x makes, with the names in hidden */
+/* bound by it - consumes hidden */
+void lopt_lambda(lopt_scope* sc, lval* x, lval* hidden) {
+    /* a body that binds names it works out as it runs, or runs code it */
+    /* builds, could rebind anything so is left as it is */
+    if(!lopt_scan(x->cell[2], &hidden)) {lval_del(hidden); return;}
+    
+    /* the body starts afresh when it is called, whatever ran before */
+    int n = sc->hidden->count;
+    int fold = sc->fold;
+    int called = sc->called;
+    int calm = sc->calm->count;
+    sc->hidden = lval_join(sc->hidden, hidden);
+    sc->fold = 1;
+    sc->called = 0;
+    lopt_call(sc, x, 2, 1);
+    sc->fold = fold;
+    sc->called = called;
+    while(sc->calm->count > calm) {
+        lval_del(lval_pop(sc->calm, sc->calm->count-1));
+    }
+    while(sc->hidden->count > n) {
+        lval_del(lval_pop(sc->hidden, sc->hidden->count-1));
+    }
+}
+
+/* adds the names a body binds with '=', def or fun to hidden */
+/* returns 0 if it binds names that aren't written out, or uses eval or */
+/* load */
+int lopt_scan(lval* v, lval** hidden) {
+    if(!LVAL_IS_LIST(ltype(v))) {return 1;}
+    
+    for(int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if(ltype(x) == LVAL_SYM) {
+            if(x->sym == sym_eval || x->sym == sym_load) {return 0;}
+            
+            int k = lenv_find(lenv_root, x->sym);
+            if(x->sym == sym_put || x->sym == sym_def
+                || (k >= 0
+                    && lval_builtin(lenv_root->vals[k]) == builtin_fun)) {
+                lval* names = (i == 0 && v->count > 1) ? v->cell[1] : NULL;
+                if(names == NULL || ltype(names) != LVAL_QEXPR) {return 0;}
+                for(int j = 0; j < names->count; j++) {
+                    if(ltype(names->cell[j]) != LVAL_SYM) {continue;}
+                    *hidden = lval_add(*hidden, lval_copy(names->cell[j]));
+                }
+            }
+        }
+        if(!lopt_scan(x, hidden)) {return 0;}
+    }
+    return 1;
+}
+
+/* returns the global a symbol refers to, if no local name hides it */
+lval* lopt_global(lopt_scope* sc, lval* x) {
+    if(ltype(x) != LVAL_SYM || lopt_hidden(sc, x->sym)) {return NULL;}
+    int i = lenv_find(lenv_root, x->sym);
+    return i < 0 ? NULL : lenv_root->vals[i];
+}
+
+/* checks whether a name is bound locally where the optimiser is */
+int lopt_hidden(lopt_scope* sc, char* sym) {
+    for(int k = 0; k < sc->hidden->count; k++) {
+        lval* h = sc->hidden->cell[k];
+        if(ltype(h) == LVAL_SYM && h->sym == sym) {return 1;}
+    }
+    return 0;
+}
+
+/* replaces the call p->cell[i] to a small user defined function g with */
+/* g's body, the arguments written in place of its formals */
+/* returns 0 if the call is left as it is */
+int lopt_inline(lopt_scope* sc, lval* p, int i, int code, lval* g) {
+    lval* x = p->cell[i];
+    if(ltype(g) != LVAL_FUN || g->fn->args) {return 0;}
+    lval* formals = g->fn->formals;
+    lval* body = g->fn->body;
+    if(formals->count == 0 || formals->count != x->count - 1) {return 0;}
+    if(lopt_nodes(body) > LOPT_INLINE) {return 0;}
+    for(int k = 0; k < formals->count; k++) {
+        if(formals->cell[k]->sym == sym_amp) {return 0;}
+    }
+    if(!lopt_movable(sc, g, body, x->cell[0]->sym, 0)) {return 0;}
+    
+    /* arguments are worked out in order before the body runs, so a name */
+    /* must be looked up before the body calls anything that could change */
+    /* it, and only one argument may do work - it must be pure and used */
+    /* once, before any call, as nothing else it does may be reordered */
+    int calls = 0;
+    for(int k = 1; k < x->count; k++) {
+        lval* a = x->cell[k];
+        if(ltype(a) != LVAL_SYM && ltype(a) != LVAL_SEXPR) {continue;}
+        char* sym = formals->cell[k-1]->sym;
+        int uses = lopt_uses(body, sym);
+        int stop = 0;
+        if(uses == 0 || lopt_before(sc, body, sym, &stop) != uses) {return 0;}
+        if(ltype(a) == LVAL_SYM) {continue;}
+        if(calls++ || uses != 1 || lopt_first(body, sym) != 1
+            || !lopt_quiet(sc, a)) {return 0;}
+    }
+    
+    /* only what folding removes is counted, inlining adds to the code */
+    long removed = lopt.removed;
+    lopt_depend(x->cell[0]->sym);
+    lopt_rely(sc);
+    lopt.inlines++;
+    lopt_replace(p, i, code, lopt_subst(body, formals, x));
+    lopt.removed = removed;
+    return 1;
+}
+
+/* checks the body of g can be moved into the code being optimised - it */
+/* mustn't bind names, make functions, run built code or call g itself, */
+/* and the names it uses must mean the same here as they do in g */
+/* formals are only replaced in code, so mustn't appear in data */
+int lopt_movable(lopt_scope* sc, lval* g, lval* v, char* self, int data) {
+    if(ltype(v) == LVAL_SYM) {
+        lval* formals = g->fn->formals;
+        for(int k = 0; k < formals->count; k++) {
+            if(formals->cell[k]->sym == v->sym) {return !data;}
+        }
+        if(data) {return 1;}
+        if(v->sym == self || v->sym == sym_put || v->sym == sym_def
+            || v->sym == sym_eval || v->sym == sym_load
+            || v->sym == sym_lambda || lopt_hidden(sc, v->sym)) {return 0;}
+        for(lenv* e = g->fn->env; e != lenv_root; e = e->par) {
+            if(!e || lenv_find(e, v->sym) >= 0) {return 0;}
+        }
+        /* looking up a missing name would fail before the arguments do */
+        return lenv_find(lenv_root, v->sym) >= 0;
+    }
+    if(!LVAL_IS_LIST(ltype(v))) {return 1;}
+    
+    /* the branches of an if are code, other q-expressions are data */
+    int branches = !data && v->count == 4
+        && lval_builtin(lopt_global(sc, v->cell[0])) == builtin_if;
+    for(int j = 0; j < v->count; j++) {
+        lval* c = v->cell[j];
+        int d = data
+            || (ltype(c) == LVAL_QEXPR && !(branches && j >= 2));
+        if(!lopt_movable(sc, g, c, self, d)) {return 0;}
+    }
+    return 1;
+}
+
+/* counts the uses of a name in an expression */
+int lopt_uses(lval* v, char* sym) {
+    if(ltype(v) == LVAL_SYM) {return v->sym == sym;}
+    if(!LVAL_IS_LIST(ltype(v))) {return 0;}
+    int n = 0;
+    for(int i = 0; i < v->count; i++) {n += lopt_uses(v->cell[i], sym);}
+    return n;
+}
+
+/* checks whether a name is looked up in the code v before anything is */
+/* called - returns 1 if so, -1 if a call may come first and 0 if v */
+/* doesn't look it up */
+int lopt_first(lval* v, char* sym) {
+    for(int i = 0; i < v->count; i++) {
+        lval* c = v->cell[i];
+        if(ltype(c) == LVAL_SYM && c->sym == sym) {return 1;}
+        if(ltype(c) != LVAL_SEXPR) {continue;}
+        int r = lopt_first(c, sym);
+        if(r) {return r;}
+        if(c->count > 1) {return -1;}
+    }
+    return 0;
+}
+
+/* counts the uses of a name in the code v before the first call to */
+/* anything but a pure builtin, setting stop once that call is passed */
+int lopt_before(lopt_scope* sc, lval* v, char* sym, int* stop) {
+    int n = 0;
+    for(int i = 0; i < v->count && !*stop; i++) {
+        lval* c = v->cell[i];
+        if(ltype(c) == LVAL_SYM && c->sym == sym) {n++;}
+        if(ltype(c) != LVAL_SEXPR) {continue;}
+        n += lopt_before(sc, c, sym, stop);
+        if(c->count > 1 && !lopt_quiet(sc, c)) {*stop = 1;}
+    }
+    return n;
+}
+
+/* checks the code v does nothing but look up names and call pure */
+/* builtins, so can't change what anything else sees */
+int lopt_quiet(lopt_scope* sc, lval* v) {
+    if(ltype(v) != LVAL_SEXPR) {return 1;}
+    if(v->count > 1
+        && !lopt_pure_fn(lval_builtin(lopt_global(sc, v->cell[0])))) {
+        return 0;
+    }
+    for(int i = 0; i < v->count; i++) {
+        if(!lopt_quiet(sc, v->cell[i])) {return 0;}
+    }
+    return 1;
+}
+
+/* checks that calling g can't redefine a global or run code it is given */
+/* seen holds the functions being looked through, which are taken to be */
+/* calm, so a function may call itself */
+int lopt_calm(lopt_scope* sc, lval* g, lval** seen, int nseen) {
+    if(g == NULL || ltype(g) != LVAL_FUN) {return 0;}
+    lbuiltin b = lval_builtin(g);
+    if(b) {
+        return b != builtin_def && b != builtin_put && b != builtin_fun
+            && b != builtin_eval && b != builtin_load && b != builtin_if;
+    }
+    
+    if(g->fn->args) {return 0;}
+    for(int k = 0; k < nseen; k++) {
+        if(seen[k] == g) {return 1;}
+    }
+    if(nseen == LOPT_CALM_DEPTH) {return 0;}
+    
+    lval* path[LOPT_CALM_DEPTH];
+    for(int k = 0; k < nseen; k++) {path[k] = seen[k];}
+    path[nseen] = g;
+    return lopt_calm_code(sc, g, g->fn->body, path, nseen + 1);
+}
+
+/* checks the code v, in the body of g, only calls calm functions - the */
+/* branches of an if are code, so every q-expression is looked at too */
+int lopt_calm_code(lopt_scope* sc, lval* g, lval* v,
+    lval** seen, int nseen) {
+    for(int i = 0; i < v->count; i++) {
+        lval* c = v->cell[i];
+        if(LVAL_IS_LIST(ltype(c))) {
+            /* a function worked out as the code runs isn't known */
+            if(i == 0 && v->count > 1) {return 0;}
+            if(!lopt_calm_code(sc, g, c, seen, nseen)) {return 0;}
+            continue;
+        }
+        if(ltype(c) != LVAL_SYM) {continue;}
+        if(c->sym == sym_def || c->sym == sym_put || c->sym == sym_eval
+            || c->sym == sym_load) {return 0;}
+        
+        /* an argument, or a name the function closes over, may be any */
+        /* function */
+        int local = 0;
+        for(int k = 0; k < g->fn->formals->count; k++) {
+            if(g->fn->formals->cell[k]->sym == c->sym) {local = 1;}
+        }
+        for(lenv* e = g->fn->env; e && e != lenv_root; e = e->par) {
+            if(lenv_find(e, c->sym) >= 0) {local = 1;}
+        }
+        if(local) {
+            if(i == 0 && v->count > 1) {return 0;}
+            continue;
+        }
+        
+        int k = lenv_find(lenv_root, c->sym);
+        if(k < 0) {
+            if(i == 0 && v->count > 1) {return 0;}
+            continue;
+        }
+        lval* h = lenv_root->vals[k];
+        if(ltype(h) != LVAL_FUN) {continue;}
+        if(lval_builtin(h) == builtin_if) {
+            /* if runs whatever it is given unless it is written out */
+            if(i != 0 || v->count != 4 || ltype(v->cell[2]) != LVAL_QEXPR
+                || ltype(v->cell[3]) != LVAL_QEXPR) {return 0;}
+            continue;
+        }
+        if(!lopt_calm(sc, h, seen, nseen)) {return 0;}
+        if(!lval_builtin(h)) {sc->calm = lval_add(sc->calm, lval_copy(c));}
+    }
+    return 1;
+}
+
+/* notes that the changes made rely on the functions called before them */
+/* staying calm */
+void lopt_rely(lopt_scope* sc) {
+    for(int k = 0; k < sc->calm->count; k++) {
+        lopt_depend(sc->calm->cell[k]->sym);
+    }
+}
+
+/* copies a function body with the arguments of the call x written in */
+/* place of its formals */
+lval* lopt_subst(lval* v, lval* formals, lval* x) {
+    if(ltype(v) == LVAL_SYM) {
+        for(int k = 0; k < formals->count; k++) {
+            if(formals->cell[k]->sym == v->sym) {
+                return lval_copy(x->cell[k+1]);
+            }
+        }
+    }
+    if(!LVAL_IS_LIST(ltype(v))) {return lval_copy(v);}
+    
+    lval* y = ltype(v) == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    for(int i = 0; i < v->count; i++) {
+        y = lval_add(y, lopt_subst(v->cell[i], formals, x));
+    }
+    return y;
+}
+
+/* checks whether x calls a pure builtin b on literal numbers */
+int lopt_pure(lbuiltin b, lval* x) {
+    if(x->count < 2 || !lopt_pure_fn(b)) {return 0;}
+    
+    for(int j = 1; j < x->count; j++) {
+        int t = ltype(x->cell[j]);
+        if(t != LVAL_NUM && t != LVAL_DBL && t != LVAL_BIG) {return 0;}
+    }
+    
+    /* big powers are left until they are needed */
+    if(b == builtin_pow && (x->count != 3 || ltype(x->cell[2]) != LVAL_NUM
+        || lnum(x->cell[2]) > 64)) {return 0;}
+    return 1;
+}
+
+/* checks whether b is one of the pure builtins */
+int lopt_pure_fn(lbuiltin b) {
+    if(!b) {return 0;}
+    for(int k = 0; k < sizeof(lopt_pures) / sizeof(lbuiltin); k++) {
+        if(lopt_pures[k] == b) {return 1;}
+    }
+    return 0;
+}
+
+/* replaces the call p->cell[i] with the expression whose items are given */
+/* consumes items */
+void lopt_replace(lval* p, int i, int code, lval* items) {
+    lval* x = p->cell[i];
+    
+    /* a body or branch is changed in place as functions may share it */
+    if(code) {
+        lopt.removed += lopt_nodes(x) - lopt_nodes(items);
+        lopt_save(x);
+        lopt_fill(x, items);
+        return;
+    }
+    
+    /* one item is the value of the expression, more are a call */
+    lval* y;
+    if(items->count == 1) {
+        y = lval_take(items, 0);
+    } else {
+        y = lval_unshare(items);
+        y->type = LVAL_SEXPR;
+    }
+    lopt.removed += lopt_nodes(x) - lopt_nodes(y);
+    lopt_save(p);
+    lval_del(x);
+    p->cell[i] = y;
+}
+
+/* counts the values in an expression */
+int lopt_nodes(lval* v) {
+    int n = 1;
+    if(LVAL_IS_LIST(ltype(v))) {
+        for(int i = 0; i < v->count; i++) {n += lopt_nodes(v->cell[i]);}
+    }
+    return n;
+}
+
+/* keeps the items of a list about to be changed, to put them back */
+void lopt_save(lval* list) {
+    if(lopt.nsites == lopt.cap) {
+        lopt.cap = lopt.cap ? lopt.cap * 2 : 64;
+        lopt.sites = realloc(lopt.sites, sizeof(lopt_site) * lopt.cap);
+    }
+    lval* old = lval_sexpr();
+    for(int i = 0; i < list->count; i++) {
+        old = lval_add(old, lval_copy(list->cell[i]));
+    }
+    lopt.sites[lopt.nsites].list = lval_copy(list);
+    lopt.sites[lopt.nsites].old = old;
+    lopt.nsites++;
+}
+
+/* sets the items of a list in place - consumes items */
+void lopt_fill(lval* list, lval* items) {
+    for(int i = 0; i < list->count; i++) {lval_del(list->cell[i]);}
+    list->count = 0;
+    lval_reserve(list, items->count);
+    for(int i = 0; i < items->count; i++) {
+        list->cell[i] = lval_copy(items->cell[i]);
+    }
+    list->count = items->count;
+    lval_del(items);
+}
+
+/* notes that the changes made rely on the global sym */
+void lopt_depend(char* sym) {
+    for(int d = 0; d < lopt.ndeps; d++) {
+        if(lopt.deps[d] == sym) {return;}
+    }
+    if(lopt.ndeps == lopt.deps_cap) {
+        lopt.deps_cap = lopt.deps_cap ? lopt.deps_cap * 2 : 16;
+        lopt.deps = realloc(lopt.deps, sizeof(char*) * lopt.deps_cap);
+    }
+    lopt.deps[lopt.ndeps++] = sym;
+}
+
+/* puts the code back as it was read if it relied on the global sym */
+/* functions running now carry on, later calls compile the old code */
+void lopt_rebind(char* sym) {
+    for(int d = 0; d < lopt.ndeps; d++) {
+        if(lopt.deps[d] == sym) {lopt_restore(); return;}
+    }
+}
+
+/* undoes every change, newest first */
+void lopt_restore(void) {
+    for(int s = lopt.nsites - 1; s >= 0; s--) {
+        lopt_fill(lopt.sites[s].list, lopt.sites[s].old);
+        lval_del(lopt.sites[s].list);
+    }
+    lopt.nsites = 0;
+    lopt.ndeps = 0;
+    lopt.epoch++;
+    lopt.restores++;
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+    return builtin_var(e, a, "def");
+}
+
+/* defines a global function from a list of its name and formals and */
+/* a body - it closes over the global environment, like one made by \ */
+/* at the prompt, so it sees the globals whatever calls fun */
+lval* builtin_fun(lenv* e, lval* a) {
+    LASSERT_NUM("fun", a, 2);
+    LASSERT_TYPE("fun", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("fun", a, 0);
+    
+    /* split the name from the formals and make the function */
+    lval* formals = lval_unshare(lval_pop(a, 0));
+    lval* name = lval_add(lval_qexpr(), lval_pop(formals, 0));
+    a = lval_add(lval_add(lval_sexpr(), formals), lval_pop(a, 0));
+    lval* f = builtin_lambda(lenv_root, a);
+    if(ltype(f) == LVAL_ERR) {lval_del(name); return f;}
+    
+    return builtin_def(e, lval_add(lval_add(lval_sexpr(), name), f));
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+    return builtin_var(e, a, "=");
+}
+
+lval* builtin_var(lenv* e, lval* a, char* func) {
+    /* the names may have been built as a vector */
+    if(a->count && ltype(a->cell[0]) == LVAL_VEC) {
+        a->cell[0] = lvec_flat(a->cell[0]);
+    }
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+        
+    /*first argument is symbol list */
+    lval* syms = a->cell[0];
+        
+    /* ensure all elements of first list are symbols */
+    for(int i = 0; i < syms->count; i++){
+        LASSERT(a, ltype(syms->cell[i]) == LVAL_SYM,
+            "Function '%s' cannot define non-symbol. "
+            "Got %s, Expected %s.", func,
+            ltype_name(ltype(syms->cell[i])), ltype_name(LVAL_SYM));
+    }
+    /* check correct number of symbols and values */
+    LASSERT(a, (syms->count == a->count-1),
+        "Function '%s' passed too many arguments for symbols. "
+        "Got %i, Expected %i.", func, syms->count, a->count-1);
+        
+    /* assign copies of values to symbols */
+    for (int i = 0; i < syms->count; i++) {
+        /* If 'def' define in globally. If 'put' define in locally */
+        if (strcmp(func, "def") == 0) {
+            lenv_def(e, syms->cell[i], a->cell[i+1]);
+        }
+    
+        if (strcmp(func, "=")   == 0) {
+            lenv_put(e, syms->cell[i], a->cell[i+1]);
+        } 
+    }
+  
+    lval_del(a);
+    return lval_sexpr();
+}
+
+
+/* applies an arithmetic operator across all of its arguments */
+/* each operator reduces over the argument array in its own loop on */
+/* longs, and only moves on to big numbers if the result overflows */
+lval* builtin_op(lenv* e, lval* a, int op) {
+  
+    /* Ensure all arguments are numbers */
+    int dbls = 0;
+    for (int i = 0; i < a->count; i++) {
+        if(ltype(a->cell[i]) == LVAL_ARR) {return builtin_op_arr(a, op);}
+        LASSERT_NUMBER(lop_names[op], a, i);
+        if(ltype(a->cell[i]) == LVAL_DBL) {dbls++;}
+    }
+    LASSERT(a, a->count != 0,
+        "Function '%s' passed no arguments.", lop_names[op]);
+    
+    /* any decimal makes the whole calculation decimal */
+    if(dbls) {return builtin_op_dbl(a, op, dbls);}
+  
+    lval** c = a->cell;
+    int n = a->count;
+    int i = 1;
+    
+    lbig xb, yb;
+    uint32_t xbuf[2], ybuf[2];
+    lbig* acc;
+    
+    if(ltype(c[0]) == LVAL_NUM) {
+        /* the result is worked out as a plain number, then made an lval */
+        long x = lnum(c[0]), y;
+        
+        switch(op) {
+            case LOP_ADD:
+                for(; i < n && ltype(c[i]) == LVAL_NUM; i++) {
+                    if(__builtin_add_overflow(x, lnum(c[i]), &y)) {break;}
+                    x = y;
+                }
+                break;
+            case LOP_SUB:
+                /* If no arguments and sub then perform unary negation */
+                if(n == 1) {
+                    if(x == LONG_MIN) {i = 0; x = 0; break;}
+                    x = -x;
+                }
+                for(; i < n && ltype(c[i]) == LVAL_NUM; i++) {
+                    if(__builtin_sub_overflow(x, lnum(c[i]), &y)) {break;}
+                    x = y;
+                }
+                break;
+            case LOP_MUL:
+                for(; i < n && ltype(c[i]) == LVAL_NUM; i++) {
+                    if(__builtin_mul_overflow(x, lnum(c[i]), &y)) {break;}
+                    x = y;
+                }
+                break;
+            /* dividing by zero, and the one division that overflows, */
+            /* are left for the big number code to sort out */
+            case LOP_DIV:
+                for(; i < n && ltype(c[i]) == LVAL_NUM; i++) {
+                    y = lnum(c[i]);
+                    if(y == 0 || (y == -1 && x == LONG_MIN)) {break;}
+                    x /= y;
+                }
+                break;
+            case LOP_MOD:
+                for(; i < n && ltype(c[i]) == LVAL_NUM; i++) {
+                    y = lnum(c[i]);
+                    if(y == 0 || (y == -1 && x == LONG_MIN)) {break;}
+                    x %= y;
+                }
+                break;
+            case LOP_POW:
+                for(; i < n && ltype(c[i]) == LVAL_NUM; i++) {
+                    if(lnum(c[i]) < 0 || !lpow_long(x, lnum(c[i]), &y)) {break;}
+                    x = y;
+                }
+                break;
+        }
+        
+        if(i == n) {lval_del(a); return lval_num(x);}
+        acc = lbig_copy(lbig_long(&xb, xbuf, x));
+    } else {
+        acc = lbig_copy(c[0]->big);
+        if(op == LOP_SUB && n == 1) {acc->neg = !acc->neg;}
+    }
+    
+    /* the rest is done on big numbers from where the fast path stopped */
+    for(; i < n; i++) {
+        lbig* y = lbig_of(c[i], &yb, ybuf);
+        lbig* r = NULL;
+        
+        switch(op) {
+            case LOP_ADD: r = lbig_add(acc, y, 0); break;
+            case LOP_SUB: r = lbig_add(acc, y, 1); break;
+            case LOP_MUL: r = lbig_mul(acc, y); break;
+            case LOP_DIV:
+            case LOP_MOD:
+                if(y->n == 0) {
+                    free(acc);
+                    lval_del(a);
+                    return lval_err("Division By Zero!");
+                }
+                r = lbig_div(acc, y, op == LOP_MOD);
+                break;
+            case LOP_POW:
+                if(acc->n == 1 && acc->d[0] == 1) {
+                    /* 1 and -1 stay the same size whatever the power */
+                    r = lbig_copy(acc);
+                    if(y->n && !(y->d[0] & 1)) {r->neg = 0;}
+                } else if(acc->n == 0) {
+                    if(y->neg) {
+                        free(acc);
+                        lval_del(a);
+                        return lval_err("Division By Zero!");
+                    }
+                    r = lbig_new(1);
+                    r->d[0] = y->n == 0;
+                } else if(y->neg) {
+                    /* a fraction, which truncates to zero */
+                    r = lbig_new(0);
+                } else {
+                    unsigned long p = y->n ? y->d[0] : 0;
+                    if(y->n > 1 || (unsigned long)acc->n * p > LBIG_MAX_LIMBS) {
+                        free(acc);
+                        lval_del(a);
+                        return lval_err("Function '^' result too large.");
+                    }
+                    r = lbig_pow(acc, p);
+                }
+                break;
+        }
+        free(acc);
+        acc = r;
+    }
+
+    lval_del(a);
+    return lval_big(acc);
+}
+
+/* applies an arithmetic operator to arguments that include decimals */
+lval* builtin_op_dbl(lval* a, int op, int dbls) {
+    lval** c = a->cell;
+    int n = a->count;
+    
+    /* promote the other numbers first so each loop only sees decimals */
+    if(dbls != n) {
+        for(int i = 0; i < n; i++) {
+            if(ltype(c[i]) != LVAL_DBL) {
+                lval* x = lval_dbl(ldbl(c[i]));
+                lval_del(c[i]);
+                c[i] = x;
+            }
+        }
+    }
+    
+    double x = c[0]->dbl;
+    switch(op) {
+        case LOP_ADD:
+            for(int i = 1; i < n; i++) {x += c[i]->dbl;}
+            break;
+        case LOP_SUB:
+            if(n == 1) {x = -x;}
+            for(int i = 1; i < n; i++) {x -= c[i]->dbl;}
+            break;
+        case LOP_MUL:
+            for(int i = 1; i < n; i++) {x *= c[i]->dbl;}
+            break;
+        case LOP_DIV:
+            for(int i = 1; i < n; i++) {
+                LASSERT(a, c[i]->dbl != 0, "Division By Zero!");
+                x /= c[i]->dbl;
+            }
+            break;
+        case LOP_MOD:
+            for(int i = 1; i < n; i++) {
+                LASSERT(a, c[i]->dbl != 0, "Division By Zero!");
+                x = fmod(x, c[i]->dbl);
+            }
+            break;
+        case LOP_POW:
+            for(int i = 1; i < n; i++) {x = pow(x, c[i]->dbl);}
+            break;
+    }
+    
+    /* the first argument is reused for the result if nothing else has it */
+    if(c[0]->refs == 1) {
+        c[0]->dbl = x;
+        return lval_take(a, 0);
+    }
+    lval_del(a);
+    return lval_dbl(x);
+}
+
+/* makes a flat array of numbers from a q-expression */
+/* the array holds decimals if any item is one, otherwise integers */
+lval* builtin_array(lenv* e, lval* a) {
+    LASSERT_NUM("array", a, 1);
+    LASSERT_TYPE("array", a, 0, LVAL_QEXPR);
+    
+    lval* q = a->cell[0];
+    int dbl = 0;
+    for(int i = 0; i < q->count; i++) {
+        int t = ltype(q->cell[i]);
+        LASSERT(a, t == LVAL_NUM || t == LVAL_DBL,
+            "Function 'array' passed incorrect type for item %i. "
+            "Got %s, Expected %s.", i, ltype_name(t), ltype_name(LVAL_NUM));
+        if(t == LVAL_DBL) {dbl = 1;}
+    }
+    
+    lval* v = lval_arr(dbl, q->count);
+    for(int i = 0; i < q->count; i++) {
+        if(dbl) {
+            v->arr->f[i] = ldbl(q->cell[i]);
+        } else {
+            v->arr->i[i] = lnum(q->cell[i]);
+        }
+    }
+    lval_del(a);
+    return v;
+}
+
+/* turns an array back into a q-expression */
+lval* builtin_array_list(lenv* e, lval* a) {
+    LASSERT_NUM("array_list", a, 1);
+    LASSERT_TYPE("array_list", a, 0, LVAL_ARR);
+    
+    lval* x = a->cell[0];
+    lval* q = lval_new(LVAL_QEXPR);
+    lval_reserve(q, x->count);
+    for(int i = 0; i < x->count; i++) {
+        q->cell[q->count++] = x->arr->dbl
+            ? lval_dbl(x->arr->f[i]) : lval_num(x->arr->i[i]);
+    }
+    lval_del(a);
+    return q;
+}
+
+/* applies + - * or / to each pair of items in two arrays, */
+/* or an array and a number */
+lval* builtin_op_arr(lval* a, int op) {
+    LASSERT_NUM(lop_names[op], a, 2);
+    LASSERT(a, op == LOP_ADD || op == LOP_SUB || op == LOP_MUL || op == LOP_DIV,
+        "Function '%s' can't be applied to arrays.", lop_names[op]);
+    
+    lval* x = lval_pop(a, 0);
+    lval* y = lval_take(a, 0);
+    lval* err = larr_pair(lop_names[op], &x, &y);
+    if(err) {return err;}
+    
+    /* the result goes into x if nothing else is using it */
+    lval* r = x->refs == 1 ? lval_copy(x) : lval_arr(x->arr->dbl, x->count);
+    if(!larr_map(op, r->arr, x->arr, y->arr, x->count)) {
+        lval_del(r);
+        r = lval_err("Division By Zero!");
+    }
+    lval_del(x);
+    lval_del(y);
+    return r;
+}
+
+/* compares each pair of items, giving an array of 1 and 0 */
+lval* builtin_ord_arr(lval* a, int op) {
+    lval* x = lval_pop(a, 0);
+    lval* y = lval_take(a, 0);
+    lval* err = larr_pair(lop_names[op], &x, &y);
+    if(err) {return err;}
+    
+    lval* r = lval_arr(0, x->count);
+    larr_ord(op, r->arr->i, x->arr, y->arr, x->count);
+    lval_del(x);
+    lval_del(y);
+    return r;
+}
+
+/* makes x and y arrays of the same kind and length for an elementwise */
+/* operation, or frees them and returns an error */
+lval* larr_pair(char* func, lval** x, lval** y) {
+    int tx = ltype(*x), ty = ltype(*y);
+    lval* err = NULL;
+    
+    if((tx != LVAL_ARR && tx != LVAL_NUM && tx != LVAL_DBL)
+        || (ty != LVAL_ARR && ty != LVAL_NUM && ty != LVAL_DBL)) {
+        err = lval_err("Function '%s' passed incorrect type. "
+            "Got %s and %s, Expected Array or Number.",
+            func, ltype_name(tx), ltype_name(ty));
+    } else if(tx == LVAL_ARR && ty == LVAL_ARR && (*x)->count != (*y)->count) {
+        err = lval_err("Function '%s' passed arrays of %i and %i items.",
+            func, (*x)->count, (*y)->count);
+    }
+    if(err) {
+        lval_del(*x);
+        lval_del(*y);
+        return err;
+    }
+    
+    int n = tx == LVAL_ARR ? (*x)->count : (*y)->count;
+    int dbl = (tx == LVAL_ARR ? (*x)->arr->dbl : tx == LVAL_DBL)
+        || (ty == LVAL_ARR ? (*y)->arr->dbl : ty == LVAL_DBL);
+    *x = larr_as(*x, dbl, n);
+    *y = larr_as(*y, dbl, n);
+    return NULL;
+}
+
+/* reduces an array with one of the LARR_ operations */
+lval* builtin_fold(lval* a, int op, char* func) {
+    int n = op == LARR_DOT ? 2 : 1;
+    LASSERT_NUM(func, a, n);
+    
+    /* a matrix is reduced over all of its items */
+    if(op != LARR_DOT && ltype(a->cell[0]) == LVAL_MAT) {
+        lmat* m = a->cell[0]->mat;
+        larr items = { .dbl = 1, .f = m->d };
+        LASSERT(a, op == LARR_SUM || m->rows * m->cols != 0,
+            "Function '%s' passed an empty matrix.", func);
+        lval* r = larr_fold(op, &items, NULL, (long)m->rows * m->cols);
+        lval_del(a);
+        return r;
+    }
+    
+    for(int i = 0; i < a->count; i++) {
+        LASSERT_TYPE(func, a, i, LVAL_ARR);
+    }
+    lval* x = a->cell[0];
+    lval* y = op == LARR_DOT ? a->cell[1] : NULL;
+    
+    if(y) {
+        LASSERT(a, x->count == y->count,
+            "Function '%s' passed arrays of %i and %i items.",
+            func, x->count, y->count);
+        /* a dot product of integers and decimals is a decimal */
+        if(x->arr->dbl != y->arr->dbl) {
+            a->cell[0] = x = larr_as(x, 1, x->count);
+            a->cell[1] = y = larr_as(y, 1, y->count);
+        }
+    }
+    if(op == LARR_MIN || op == LARR_MAX) {
+        LASSERT(a, x->count != 0, "Function '%s' passed an empty array.", func);
+    }
+    
+    lval* r = larr_fold(op, x->arr, y ? y->arr : NULL, x->count);
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+    return builtin_fold(a, LARR_SUM, "sum");
+}
+
+lval* builtin_min(lenv* e, lval* a) {
+    return builtin_fold(a, LARR_MIN, "min");
+}
+
+lval* builtin_max(lenv* e, lval* a) {
+    return builtin_fold(a, LARR_MAX, "max");
+}
+
+lval* builtin_dot(lenv* e, lval* a) {
+    return builtin_fold(a, LARR_DOT, "dot");
+}
+
+/* makes a matrix from a q-expression of rows of numbers */
+lval* builtin_matrix(lenv* e, lval* a) {
+    LASSERT_NUM("matrix", a, 1);
+    LASSERT_TYPE("matrix", a, 0, LVAL_QEXPR);
+    
+    lval* q = a->cell[0];
+    int cols = q->count ? q->cell[0]->count : 0;
+    for(int i = 0; i < q->count; i++) {
+        lval* r = q->cell[i];
+        LASSERT(a, ltype(r) == LVAL_QEXPR && r->count == cols,
+            "Function 'matrix' passed row %i that isn't a list of %i numbers.",
+            i, cols);
+        for(int j = 0; j < cols; j++) {
+            int t = ltype(r->cell[j]);
+            LASSERT(a, t == LVAL_NUM || t == LVAL_DBL || t == LVAL_BIG,
+                "Function 'matrix' passed incorrect type in row %i. "
+                "Got %s, Expected %s.", i, ltype_name(t), ltype_name(LVAL_NUM));
+        }
+    }
+    
+    lval* m = lval_mat(q->count, cols);
+    for(int i = 0; i < q->count; i++) {
+        for(int j = 0; j < cols; j++) {
+            m->mat->d[(long)i * cols + j] = ldbl(q->cell[i]->cell[j]);
+        }
+    }
+    lval_del(a);
+    return m;
+}
+
+/* makes a rows by cols matrix from the items of an array, row by row */
+lval* builtin_reshape(lenv* e, lval* a) {
+    LASSERT_NUM("reshape", a, 3);
+    LASSERT_TYPE("reshape", a, 0, LVAL_NUM);
+    LASSERT_TYPE("reshape", a, 1, LVAL_NUM);
+    LASSERT(a, ltype(a->cell[2]) == LVAL_ARR || ltype(a->cell[2]) == LVAL_MAT,
+        "Function 'reshape' passed incorrect type for argument 2. "
+        "Got %s, Expected %s.", ltype_name(ltype(a->cell[2])), ltype_name(LVAL_ARR));
+    
+    long rows = lnum(a->cell[0]), cols = lnum(a->cell[1]);
+    lval* x = a->cell[2];
+    long n = ltype(x) == LVAL_MAT ? (long)x->mat->rows * x->mat->cols : x->count;
+    LASSERT(a, rows >= 0 && cols >= 0 && rows * cols == n,
+        "Function 'reshape' can't make %li items into %li by %li.",
+        n, rows, cols);
+    
+    lval* m = lval_mat(rows, cols);
+    if(ltype(x) == LVAL_MAT) {
+        memcpy(m->mat->d, x->mat->d, sizeof(double) * n);
+    } else if(x->arr->dbl) {
+        memcpy(m->mat->d, x->arr->f, sizeof(double) * n);
+    } else {
+        for(long i = 0; i < n; i++) {m->mat->d[i] = (double)x->arr->i[i];}
+    }
+    lval_del(a);
+    return m;
+}
+
+/* returns the number of rows and columns of a matrix */
+lval* builtin_shape(lenv* e, lval* a) {
+    LASSERT_NUM("shape", a, 1);
+    LASSERT_TYPE("shape", a, 0, LVAL_MAT);
+    lval* v = lval_qexpr();
+    v = lval_add(v, lval_num(a->cell[0]->mat->rows));
+    v = lval_add(v, lval_num(a->cell[0]->mat->cols));
+    lval_del(a);
+    return v;
+}
+
+/* multiplies two matrices */
+lval* builtin_matmul(lenv* e, lval* a) {
+    LASSERT_NUM("matmul", a, 2);
+    LASSERT_TYPE("matmul", a, 0, LVAL_MAT);
+    LASSERT_TYPE("matmul", a, 1, LVAL_MAT);
+    
+    lmat* x = a->cell[0]->mat;
+    lmat* y = a->cell[1]->mat;
+    LASSERT(a, x->cols == y->rows,
+        "Function 'matmul' can't multiply %i by %i and %i by %i matrices.",
+        x->rows, x->cols, y->rows, y->cols);
+    
+    lval* m = lval_mat(x->rows, y->cols);
+    lmat_mul(m->mat, x, y);
+    lval_del(a);
+    return m;
+}
+
+lval* builtin_transpose(lenv* e, lval* a) {
+    LASSERT_NUM("transpose", a, 1);
+    LASSERT_TYPE("transpose", a, 0, LVAL_MAT);
+    lmat* x = a->cell[0]->mat;
+    lval* m = lval_mat(x->cols, x->rows);
+    lmat_transpose(m->mat, x);
+    lval_del(a);
+    return m;
+}
+
+/* returns row or column i of a matrix as an array */
+lval* builtin_slice_mat(lval* a, char* func, int col) {
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_MAT);
+    LASSERT_TYPE(func, a, 1, LVAL_NUM);
+    
+    lmat* x = a->cell[0]->mat;
+    long i = lnum(a->cell[1]);
+    int n = col ? x->rows : x->cols;
+    LASSERT(a, i >= 0 && i < (col ? x->cols : x->rows),
+        "Function '%s' passed index %li out of range.", func, i);
+    
+    lval* v = lval_arr(1, n);
+    if(col) {
+        for(int k = 0; k < n; k++) {v->arr->f[k] = x->d[(long)k * x->cols + i];}
+    } else {
+        memcpy(v->arr->f, x->d + i * x->cols, sizeof(double) * n);
+    }
+    lval_del(a);
+    return v;
+}
+
+lval* builtin_row(lenv* e, lval* a) {
+    return builtin_slice_mat(a, "row", 0);
+}
+
+lval* builtin_col(lenv* e, lval* a) {
+    return builtin_slice_mat(a, "col", 1);
+}
+
+/* sums each row or each column of a matrix into an array */
+lval* builtin_sums_mat(lval* a, char* func, int col) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_MAT);
+    
+    lmat* x = a->cell[0]->mat;
+    lval* v = lval_arr(1, col ? x->cols : x->rows);
+    if(col) {
+        /* add each row into the column totals */
+        memset(v->arr->f, 0, sizeof(double) * x->cols);
+        for(int i = 0; i < x->rows; i++) {
+            larr_axpy(v->arr->f, 1, x->d + (long)i * x->cols, x->cols);
+        }
+    } else {
+        for(int i = 0; i < x->rows; i++) {
+            larr row = { .dbl = 1, .f = x->d + (long)i * x->cols };
+            lval* s = larr_fold(LARR_SUM, &row, NULL, x->cols);
+            v->arr->f[i] = s->dbl;
+            lval_del(s);
+        }
+    }
+    lval_del(a);
+    return v;
+}
+
+lval* builtin_row_sums(lenv* e, lval* a) {
+    return builtin_sums_mat(a, "row_sums", 0);
+}
+
+lval* builtin_col_sums(lenv* e, lval* a) {
+    return builtin_sums_mat(a, "col_sums", 1);
+}
+
+/* compares the order of numeric values (<, >, <=, >=) */
+lval* builtin_ord(lenv* e, lval* a, int op) {
+    LASSERT_NUM(lop_names[op], a, 2);
+    if(ltype(a->cell[0]) == LVAL_ARR || ltype(a->cell[1]) == LVAL_ARR) {
+        return builtin_ord_arr(a, op);
+    }
+    LASSERT_NUMBER(lop_names[op], a, 0);
+    LASSERT_NUMBER(lop_names[op], a, 1);
+    
+    /* c is the sign of the first number minus the second */
+    int c;
+    int tx = ltype(a->cell[0]), ty = ltype(a->cell[1]);
+    if(tx == LVAL_NUM && ty == LVAL_NUM) {
+        long x = lnum(a->cell[0]), y = lnum(a->cell[1]);
+        c = (x > y) - (x < y);
+    } else if(tx == LVAL_DBL || ty == LVAL_DBL) {
+        double x = ldbl(a->cell[0]), y = ldbl(a->cell[1]);
+        c = (x > y) - (x < y);
+    } else {
+        lbig xb, yb;
+        uint32_t xbuf[2], ybuf[2];
+        c = lbig_cmp(lbig_of(a->cell[0], &xb, xbuf),
+            lbig_of(a->cell[1], &yb, ybuf));
+    }
+    
+    int r = 0;
+    switch(op) {
+        case LOP_GT: r = c > 0; break;
+        case LOP_LT: r = c < 0; break;
+        case LOP_GE: r = c >= 0; break;
+        case LOP_LE: r = c <= 0; break;
+    }
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_cmp(lenv* e, lval* a, int op) {
+    LASSERT_NUM(lop_names[op], a, 2);
+    int r;
+    int tx = ltype(a->cell[0]), ty = ltype(a->cell[1]);
+    
+    /* a decimal equals any number with the same value */
+    if((tx == LVAL_DBL && (ty == LVAL_NUM || ty == LVAL_BIG))
+        || (ty == LVAL_DBL && (tx == LVAL_NUM || tx == LVAL_BIG))) {
+        r = ldbl(a->cell[0]) == ldbl(a->cell[1]);
+    } else {
+        r = lval_eq(a->cell[0], a->cell[1]);
+    }
+    if(op == LOP_NE) {r = !r;}
+    lval_del(a);
+    return lval_num(r);
+}
+
+/* returns the first element of a q-expression as a new q-expression */
+/* frees the rest */
+lval* builtin_head(lenv* e, lval* a) {
+    LASSERT_NUM("head", a, 1);
+    LASSERT_LIST("head", a, 0);
+    LASSERT_NOT_EMPTY("head", a, 0);
+    lval* x = a->cell[0];
+    x = ltype(x) == LVAL_VEC ? lvec_nth(x, 0) : x->cell[0];
+    lval* v = lval_add(lval_qexpr(), lval_copy(x));
+    lval_del(a);
+    return v;
+}
+
+/* returns a q-expression with the first element removed */
+lval* builtin_tail(lenv* e, lval* a){
+    LASSERT_NUM("tail", a, 1);
+    LASSERT_LIST("tail", a, 0);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+    
+    if(ltype(a->cell[0]) == LVAL_VEC) {
+        lval* v = lvec_slice(a->cell[0], 1, a->cell[0]->count - 1);
+        lval_del(a);
+        return v;
+    }
+        
+    lval* v = lval_unshare(lval_take(a, 0));
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+/* converts an s-expression into a q-expression */
+lval* builtin_list(lenv* e, lval* a) {
+    a = lval_unshare(a);
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+/* converts a q-expression into an s-expression and evaluates it */
+lval* builtin_eval(lenv* e, lval* a) {
+    LASSERT_NUM("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+    
+    lval* x = lval_unshare(lval_take(a, 0));
+    x->type = LVAL_SEXPR;
+    return lval_exec(e, x);
+}
+
+/* joins multiple q-expressions together */
+lval* builtin_join(lenv* e, lval* a) {
+    int vecs = 0;
+    for(int i = 0; i < a->count; i++) {
+        LASSERT_LIST("join", a, i);
+        if(ltype(a->cell[i]) == LVAL_VEC) {vecs++;}
+    }
+    
+    /* joining onto a vector shares both sides instead of copying */
+    if(vecs) {
+        lval* x = lvec_from(lval_pop(a, 0));
+        while(a->count) {
+            x = lvec_cat(x, lvec_from(lval_pop(a, 0)));
+        }
+        lval_del(a);
+        return x;
+    }
+    
+    lval* x = lval_unshare(lval_pop(a, 0));
+    
+    while(a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+    
+    lval_del(a);
+    return x;
+}
+
+/* turns a q-expression into a vector */
+lval* builtin_vec(lenv* e, lval* a) {
+    LASSERT_NUM("vec", a, 1);
+    LASSERT_LIST("vec", a, 0);
+    return lvec_from(lval_take(a, 0));
+}
+
+/* returns item n of a list or vector */
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT_NUM("nth", a, 2);
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_LIST("nth", a, 1);
+    
+    long n = lnum(a->cell[0]);
+    lval* x = a->cell[1];
+    LASSERT(a, n >= 0 && n < x->count,
+        "Function 'nth' passed index %li out of range for %i items.",
+        n, x->count);
+    
+    x = lval_copy(ltype(x) == LVAL_VEC ? lvec_nth(x, n) : x->cell[n]);
+    lval_del(a);
+    return x;
+}
+
+/* returns count items of a list or vector from start, as a vector */
+lval* builtin_slice(lenv* e, lval* a) {
+    LASSERT_NUM("slice", a, 3);
+    LASSERT_TYPE("slice", a, 0, LVAL_NUM);
+    LASSERT_TYPE("slice", a, 1, LVAL_NUM);
+    LASSERT_LIST("slice", a, 2);
+    
+    long from = lnum(a->cell[0]), n = lnum(a->cell[1]);
+    lval* x = a->cell[2];
+    LASSERT(a, from >= 0 && n >= 0 && from + n <= x->count,
+        "Function 'slice' passed range %li to %li out of range for %i items.",
+        from, from + n, x->count);
+    
+    x = lvec_from(lval_copy(x));
+    lval* v = lvec_slice(x, from, n);
+    lval_del(x);
+    lval_del(a);
+    return v;
+}
+
+/* function for adding */
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_ADD);
+}
+
+/* function for subtracting */
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_SUB);
+}
+
+/* function for multiplying */
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_MUL);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_DIV);
+}
+
+/* applies a C library maths function to a number */
+lval* builtin_math(lval* a, char* func, double (*f)(double)) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_NUMBER(func, a, 0);
+    double x = f(ldbl(a->cell[0]));
+    lval_del(a);
+    return lval_dbl(x);
+}
+
+lval* builtin_sqrt(lenv* e, lval* a) {
+    return builtin_math(a, "sqrt", sqrt);
+}
+
+lval* builtin_exp(lenv* e, lval* a) {
+    return builtin_math(a, "exp", exp);
+}
+
+lval* builtin_log(lenv* e, lval* a) {
+    return builtin_math(a, "log", log);
+}
+
+lval* builtin_sin(lenv* e, lval* a) {
+    return builtin_math(a, "sin", sin);
+}
+
+lval* builtin_cos(lenv* e, lval* a) {
+    return builtin_math(a, "cos", cos);
+}
+
+lval* builtin_floor(lenv* e, lval* a) {
+    return builtin_math(a, "floor", floor);
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_MOD);
+}
+
+lval* builtin_pow(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_POW);
+}
+
+lval* builtin_exit(lenv* e, lval* a) {
+    return lval_exit();
+}
+
+lval* builtin_lenv_print(lenv* e, lval* a) {
+    for(int i = 0; i < e->count; i++) {
+        printf("%s: ", e->syms[i]);
+        lval_println(e->vals[i]);
+        
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* prints how long the collector has paused evaluation for */
+lval* builtin_gc_stats(lenv* e, lval* a) {
+    printf("pauses: %li\n", gc.npauses);
+    long seen = 0;
+    long p50 = -1, p99 = -1;
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if(gc.pauses[i] == 0) {continue;}
+        printf("  < %lius: %li\n", 1L << i, gc.pauses[i]);
+        
+        /* percentiles are the upper bound of their bucket */
+        seen += gc.pauses[i];
+        if(p50 < 0 && seen * 2 >= gc.npauses) {p50 = 1L << i;}
+        if(p99 < 0 && seen * 100 >= gc.npauses * 99) {p99 = 1L << i;}
+    }
+    printf("p50 < %lius, p99 < %lius, max %.0fus\n", p50, p99, gc.pause_max);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* prints how many objects have been allocated and how many are in use */
+lval* builtin_mem_stats(lenv* e, lval* a) {
+    printf("lvals: %li live, %li allocated\n",
+        gc.vals.live + gc.lists.live, gc.vals.allocs + gc.lists.allocs);
+    for(int t = 0; t <= LVAL_MAT; t++) {
+        if(gc.val_allocs[t] == 0) {continue;}
+        printf("  %s: %li\n", ltype_name(t), gc.val_allocs[t]);
+    }
+    printf("lenvs: %li live, %li allocated\n", gc.envs.live, gc.envs.allocs);
+    printf("arrays:\n");
+    for(int c = 0; c < LSLAB_CLASSES; c++) {
+        printf("  %i items: %li live, %li allocated\n",
+            1 << c, gc.slabs[c].live, gc.slabs[c].allocs);
+    }
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* sets how much the collector may free in one step */
+lval* builtin_gc_budget(lenv* e, lval* a) {
+    LASSERT_NUM("gc_budget", a, 1);
+    LASSERT_TYPE("gc_budget", a, 0, LVAL_NUM);
+    LASSERT(a, lnum(a->cell[0]) > 0,
+        "Function 'gc_budget' passed a budget of %li, Expected at least 1.",
+        lnum(a->cell[0]));
+    gc.budget = lnum(a->cell[0]);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* sets how many calls a function takes to be compiled to machine code */
+lval* builtin_jit_threshold(lenv* e, lval* a) {
+    LASSERT_NUM("jit_threshold", a, 1);
+    LASSERT_TYPE("jit_threshold", a, 0, LVAL_NUM);
+    LASSERT(a, lnum(a->cell[0]) >= 0,
+        "Function 'jit_threshold' passed a threshold of %li, "
+        "Expected at least 0.", lnum(a->cell[0]));
+    jit_threshold = lnum(a->cell[0]);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* prints what the optimiser has done to the code loaded so far */
+lval* builtin_opt_stats(lenv* e, lval* a) {
+    printf("calls folded: %li\n", lopt.folds);
+    printf("ifs pruned: %li\n", lopt.prunes);
+    printf("calls inlined: %li\n", lopt.inlines);
+    printf("nodes removed: %li\n", lopt.removed);
+    printf("put back: %li\n", lopt.restores);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    /* Check Two arguments, each of which are Q-Expressions */
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+    
+    /* Check first Q-Expression contains only Symbols */
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (ltype(a->cell[0]->cell[i]) == LVAL_SYM),
+            "Cannot define non-symbol. Got %s, Expected %s.",
+            ltype_name(ltype(a->cell[0]->cell[i])),ltype_name(LVAL_SYM));
+    }
+    
+    /* Pop first two arguments and pass them to lval_lambda */
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+    
+    return lval_lambda(e, formals, body);
+    
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_GT);
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_LT);
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_GE);
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_LE);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+    return builtin_cmp(e, a, LOP_EQ);
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+    return builtin_cmp(e, a, LOP_NE);
+}
+
+/* function for if statements */
+lval* builtin_if(lenv* e, lval* a) {
+    LASSERT_NUM("if", a, 3);
+    LASSERT_TYPE("if", a, 0, LVAL_NUM);
+    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+    
+    /* take the chosen expression and mark it as evaluable (s-expression) */
+    /* if condition is true it is the first expression, otherwise second */
+    lval* x = lval_unshare(lval_pop(a, lnum(a->cell[0]) ? 1 : 2));
+    x->type = LVAL_SEXPR;
+    x = lval_exec(e, x);
+    
+    /* Delete argument list and return */
+    lval_del(a);
+    return x;
+}
+
+/* loads and evaluates an external file */
+lval* builtin_load(lenv* e, lval* a){
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+    
+    /* parse file given by string name */
+    mpc_result_t r;
+    if(mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+        /* read contents */
+        lval* expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+        
+        /* evaluate each expression */
+        while(expr->count) {
+            gc_safepoint();
+            lval* x = lval_exec(e, lopt_run(e, lval_pop(expr, 0)));
+            /* if evaluation leads to error print it */
+            if(ltype(x) == LVAL_ERR) {
+                lval_println(x);
+            }
+            lval_del(x);
+        }
+        /* delete expressions and arguments */
+        lval_del(expr);
+        lval_del(a);
+        /* return empty list */
+        return lval_sexpr();
+    } else {
+        /* get parse error as string */
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+        
+        /* create new error message using it */
+        lval* err = lval_err("Could not load Library %s", err_msg);
+        
+        /* clean up and return error */
+        free(err_msg);
+        lval_del(a);
+        return err;
+    }
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+
+    /* Print each argument followed by a space */
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]); putchar(' ');
+    }
+
+    /* Print a newline and delete arguments */
+    putchar('\n');
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+    /* Construct Error from first argument */
+    lval* err = lval_err(a->cell[0]->str);
+
+    /* Delete arguments and return */
+    lval_del(a);
+    return err;
+}
+
+/* allocate a new lval of the given type with a single owner */
+lval* lval_new(int type) {
+    lval* v;
+    if(LVAL_IS_LIST(type)) {
+        v = lpool_alloc(&gc.lists);
+        v->count = 0;
+        v->cell = LLIST(v)->inl;
+        LLIST(v)->cap = LVAL_INLINE;
+        LLIST(v)->start = 0;
+    } else {
+        v = lpool_alloc(&gc.vals);
+    }
+    gc.val_allocs[type]++;
+    gc.debt++;
+    v->type = type;
+    v->refs = 1;
+    v->gen = GEN_YOUNG;
+    v->gc_flags = 0;
+    
+    /* remember it for the next minor collection */
+    if(gc.nyoung_vals == gc.young_vals_cap) {
+        gc.young_vals_cap = gc.young_vals_cap ? gc.young_vals_cap * 2 : 1024;
+        gc.young_vals = realloc(gc.young_vals,
+            sizeof(lval*) * gc.young_vals_cap);
+    }
+    gc.young_vals[gc.nyoung_vals++] = v;
+    return v;
+}
+
+/* create a new number type lval, a fixnum unless it is too big */
+lval* lval_num(long x) {
+    if(x >= LFIX_MIN && x <= LFIX_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | LTAG_FIXNUM);
+    }
+    lval* v = lval_new(LVAL_NUM);
+    v->num = x;
+    return v;
+}
+
+/* create a new decimal type lval */
+lval* lval_dbl(double x) {
+    lval* v = lval_new(LVAL_DBL);
+    v->dbl = x;
+    return v;
+}
+
+/* the value of any kind of number as a double */
+double ldbl(lval* x) {
+    switch(ltype(x)) {
+        case LVAL_DBL: return x->dbl;
+        case LVAL_NUM: return (double)lnum(x);
+        case LVAL_BIG: {
+            double d = 0;
+            for(int i = x->big->n - 1; i >= 0; i--) {
+                d = d * 4294967296.0 + x->big->d[i];
+            }
+            return x->big->neg ? -d : d;
+        }
+    }
+    return 0;
+}
+
+/* create a new error type lval */
+lval* lval_err(char* fmt, ...) {
+    lval* v = lval_new(LVAL_ERR);
+    
+    /* create a va list and initialize it */
+    va_list va;
+    va_start(va, fmt);
+    
+    /* allocate 512 bytes */
+    v->err = malloc(512);
+    /*print the error string with max of 511 characters */
+    vsnprintf(v->err, 511, fmt, va);
+    
+    /* reallocate to number of bytes actually used */
+    v->err = realloc(v->err, strlen(v->err)+1);
+    
+    /* clean up our va list */
+    va_end(va);
+    
+    return v;
+}
+
+/* construct a pointer to a new symbol lval */
+lval* lval_sym(char* s) {
+    lval* v = lval_new(LVAL_SYM);
+    v->sym = lsym_intern(s);
+    return v;
+}
+
+/* returns the empty Sexpr, lval_add copies it before adding to it */
+lval* lval_sexpr(void) {
+    return lval_copy(&lval_empty_sexpr.v);
+}
+
+/* returns the empty Qexpr */
+lval* lval_qexpr(void) {
+    return lval_copy(&lval_empty_qexpr.v);
+}
+
+/* returns a builtin function, tagged with its index in the table */
+lval* lval_fun(lbuiltin func) {
+    int i = 0;
+    while(i < nbuiltins && builtins[i] != func) {i++;}
+    if(i == nbuiltins) {
+        /* the index is kept in the tag, raise LBUILTIN_MAX to add more */
+        if(nbuiltins == LBUILTIN_MAX) {
+            fputs("Error: Too many builtins, raise LBUILTIN_MAX\n", stderr);
+            abort();
+        }
+        builtins[nbuiltins++] = func;
+    }
+    return (lval*)(((uintptr_t)i << 3) | LTAG_BUILTIN);
+}
+
+/* constructor for user defined functions */
+/* the function closes over e, the environment it was defined in */
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+    lval* v = lval_new(LVAL_FUN);
+    v->fn = lpool_alloc(&gc.funcs);
+    
+    /* each call binds its arguments in a new frame inside e */
+    v->fn->env = lenv_ref(e);
+    v->fn->args = NULL;
+    
+    /* set formals and body */
+    v->fn->formals = formals;
+    v->fn->body = body;
+    
+    /* body is compiled on first call */
+    v->fn->code = lcode_new();
+    return v;
+}
+
+/* constructor for string lvals */
+lval* lval_str(char* s) {
+    lval* v = lval_new(LVAL_STR);
+    v->str = malloc(strlen(s) + 1);
+    strcpy(v->str, s);
+    return v;
+}
+
+lval* lval_exit() {
+    lval* v = lval_new(LVAL_EXIT);
+    return v;
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+    /* a point or exponent makes it a decimal */
+    if(strpbrk(t->contents, ".eE")) {
+        return lval_dbl(strtod(t->contents, NULL));
+    }
+    
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    /* numbers too long for a long are read as big numbers */
+    return errno != ERANGE ?
+        lval_num(x) : lval_big(lbig_read(t->contents));
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+    /* cut off the final quote character */
+    t->contents[strlen(t->contents)-1] = '\0';
+    /* copy the string missing out the first quote character */
+    char* unescaped = malloc(strlen(t->contents+1)+1);
+    strcpy(unescaped, t->contents+1);
+    /* pass through the unescape function */
+    unescaped = mpcf_unescape(unescaped);
+    /*construct a new lval using the string */
+    lval* str = lval_str(unescaped);
+    /* free the string and return */
+    free(unescaped);
+    return str;
+}
+
+lval* lval_read(mpc_ast_t* t) {
+    /* if symbol or number return conversion to that type */
+    if (strstr(t->tag, "number")) {return lval_read_num(t);}
+    if (strstr(t->tag, "symbol")) {return lval_sym(t->contents);}
+    if (strstr(t->tag, "string")) {return lval_read_str(t);}
+    
+    /* if root (>) or sexpr then create empty list */
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) {x = lval_sexpr();}
+    if(strstr(t->tag, "sexpr")) {x = lval_sexpr();}
+    if (strstr(t->tag, "qexpr")) {x = lval_qexpr();}
+    
+    /*fill this list with valid expression contained within */
+    for(int i = 0; i < t->children_num; i++) {
+        if(strcmp(t->children[i]->contents, "(") == 0) { continue; }
+        if(strcmp(t->children[i]->contents, ")") == 0) { continue; }
+        if(strcmp(t->children[i]->contents, "{") == 0) { continue; }
+        if(strcmp(t->children[i]->contents, "}") == 0) { continue; }
+        if(strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+        if(strstr(t->children[i]->tag, "comment")) {continue;}
+        x = lval_add(x, lval_read(t->children[i]));
+    }
+    return x;
+}
+
+lval* lval_add(lval* v, lval* x) {
+    /* v may be the shared empty list */
+    v = lval_unshare(v);
+    lval_reserve(v, v->count+1);
+    v->cell[v->count++] = x;
+    return v;
+}
+
+/* makes room in a list for n items from its first one */
+/* short lists use the cells inside the lval, longer ones an array */
+void lval_reserve(lval* v, int n) {
+    llist* l = LLIST(v);
+    if(l->start + n <= l->cap) {return;}
+    lval** base = v->cell - l->start;
+    
+    /* reuse the space left by popping from the front if at least half */
+    /* the buffer is free, otherwise at least double it */
+    if(n <= l->cap && l->start >= v->count) {
+        memmove(base, v->cell, sizeof(lval*) * v->count);
+    } else {
+        int cap = l->cap * 2 > n ? l->cap * 2 : n;
+        lval** cell = lslab_alloc(cap);
+        memcpy(cell, v->cell, sizeof(lval*) * v->count);
+        if(base != l->inl) {lslab_free(base, l->cap);}
+        base = cell;
+        l->cap = 1 << lslab_class(cap);
+    }
+    v->cell = base;
+    l->start = 0;
+}
+
+/* removes and returns a child element of an s-expression */
+lval* lval_pop(lval* v, int i) {
+    /* find the item at "i" */
+    lval* x = v->cell[i];
+    
+    /* the first item is popped by moving the start of the list along */
+    if(i == 0) {
+        v->cell++;
+        LLIST(v)->start++;
+        v->count--;
+        return x;
+    }
+    
+    /* shift memory after the item at "i" over the top */
+    memmove(&v->cell[i], &v->cell[i+1],
+        sizeof(lval*) * (v->count-i-1));
+        
+    /* decrease the count of items in the list */
+    v->count--;
+    return x;
+}
+
+/* returns one element of an s-expression and frees the rest */
+lval* lval_take(lval* v, int i) {
+    /* a shared list is left alone, we just take a reference to the item */
+    if(v->refs > 1) {
+        lval* x = lval_copy(v->cell[i]);
+        lval_del(v);
+        return x;
+    }
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+/* joins one q-expression to another */
+lval* lval_join(lval* x, lval* y) {
+    x = lval_unshare(x);
+    lval_reserve(x, x->count + y->count);
+    memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+    x->count += y->count;
+    
+    /* the cells move over if y is ours, otherwise they are now shared */
+    if(y->refs == 1) {
+        y->count = 0;
+    } else {
+        for(int i = 0; i < y->count; i++) {lval_copy(y->cell[i]);}
+    }
+    
+    /* delete the empty 'y' and return 'x' */
+    lval_del(y);
+    return x;
+}
+
+/* returns a reference to an lval - the value itself is shared */
+lval* lval_copy(lval* v) {
+    if(LVAL_IMM(v)) {return v;}
+    v->refs++;
+    return v;
+}
+
+/* consumes a reference to v and returns an lval that is only ours */
+/* shared values are copied one level deep, their children stay shared */
+lval* lval_unshare(lval* v) {
+    /* immediates are never changed in place */
+    if(LVAL_IMM(v) || v->refs == 1) {return v;}
+    v->refs--;
+    
+    lval* x = lval_new(v->type);
+    
+    switch(v->type) {
+        /* copy functions and numbers directly */
+        case LVAL_FUN: 
+            x->fn = lpool_alloc(&gc.funcs);
+            x->fn->env = lenv_ref(v->fn->env);
+            x->fn->formals = lval_copy(v->fn->formals);
+            x->fn->body = lval_copy(v->fn->body);
+            x->fn->code = v->fn->code;
+            x->fn->code->refs++;
+            x->fn->args = v->fn->args ? lval_copy(v->fn->args) : NULL;
+            break;
+        case LVAL_NUM: x->num = v->num; break;
+        case LVAL_BIG: x->big = lbig_copy(v->big); break;
+        case LVAL_DBL: x->dbl = v->dbl; break;
+        case LVAL_ARR:
+            x->arr = lval_arr(v->arr->dbl, v->count)->arr;
+            x->count = v->count;
+            memcpy(x->arr->i, v->arr->i, sizeof(int64_t) * v->count);
+            break;
+        case LVAL_MAT:
+            x->mat = lval_mat(v->mat->rows, v->mat->cols)->mat;
+            x->count = v->count;
+            memcpy(x->mat->d, v->mat->d,
+                sizeof(double) * v->mat->rows * v->mat->cols);
+            break;
+        
+        /* copy strings using malloc and strcpy */
+        case LVAL_ERR:
+            x->err = malloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err); break;
+            
+        case LVAL_SYM:
+            x->sym = v->sym; break;
+            
+        case LVAL_STR:
+            x->str = malloc(strlen(v->str) + 1);
+            strcpy(x->str, v->str);
+            break;
+            
+        /* copy lists by sharing each sub-expression */
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lval_reserve(x, v->count);
+            x->count = v->count;
+            for(int i = 0; i < x->count; i++) {
+                x->cell[i] = lval_copy(v->cell[i]);
+            }
+            break;
+        
+        /* vectors are never changed in place, but copy the top anyway */
+        case LVAL_VEC:
+            x->vec = lpool_alloc(&gc.vecs);
+            *x->vec = *v->vec;
+            if(x->vec->base) {
+                lval_copy(x->vec->base);
+            } else {
+                lval_copy(x->vec->left);
+                lval_copy(x->vec->right);
+            }
+            x->count = v->count;
+            lvec_live++;
+            break;
+        case LVAL_EXIT: break;
+    }
+    return x;
+}
+
+
+/* binds arguments to the formals of a user defined function */
+/* consumes the arguments and returns an error, or a partial application */
+/* if some are still missing - otherwise returns NULL, with a new frame */
+/* holding every argument in *frame, ready to run the body in */
+lval* lval_bind(lval* f, lval* a, lenv** frame) {
+    lval* formals = f->fn->formals;
+    lval* args = f->fn->args;
+    int given = a->count;
+    int bound = args ? args->count : 0;
+    
+    /* formals before an '&' take one argument each */
+    int total = formals->count;
+    int amp = total;
+    for(int i = 0; i < total; i++) {
+        if(formals->cell[i]->sym == sym_amp) {amp = i; break;}
+    }
+    
+    if(amp == total && bound + given > total) {
+        lval_del(a); return lval_err(
+            "Function passed too many arguments. "
+            "Got %i, Expected %i.", given, total - bound); 
+    }
+    
+    /* some are missing - share the function and keep what we have */
+    if(bound + given < amp) {
+        lval* p = lval_new(LVAL_FUN);
+        p->fn = lpool_alloc(&gc.funcs);
+        p->fn->env = lenv_ref(f->fn->env);
+        p->fn->formals = lval_copy(formals);
+        p->fn->body = lval_copy(f->fn->body);
+        p->fn->code = f->fn->code;
+        p->fn->code->refs++;
+        p->fn->args = args ? lval_join(lval_copy(args), a) : a;
+        return p;
+    }
+    
+    /* Ensure '&' is followed by another symbol */
+    if(amp != total && amp != total - 2) {
+        lval_del(a);
+        return lval_err("Function format invalid. "
+            "Symbol '&' not followed by single symbol.");
+    }
+    
+    /* Bind each argument in a frame sized for them, in the order of the */
+    /* formals - the arguments are moved into it if the list is ours */
+    lenv* x = lenv_frame(f->fn->env, amp == total ? total : amp + 1);
+    int own = a->refs == 1;
+    for(int i = 0; i < bound; i++) {
+        lenv_bind(x, formals->cell[i]->sym, lval_copy(args->cell[i]));
+    }
+    for(int i = 0; i < given; i++) {
+        if(!own) {lval_copy(a->cell[i]);}
+    }
+    for(int i = 0; i < amp - bound; i++) {
+        lenv_bind(x, formals->cell[bound + i]->sym, a->cell[i]);
+    }
+    
+    /* the symbol after '&' is bound to a list of the rest */
+    if(amp != total) {
+        lval* rest = lval_qexpr();
+        for(int i = amp - bound; i < given; i++) {
+            rest = lval_add(rest, a->cell[i]);
+        }
+        lenv_bind(x, formals->cell[amp + 1]->sym, rest);
+    }
+
+    /* Argument list is now bound so can be cleaned up */
+    a->count = 0;
+    lval_del(a);
+    *frame = x;
+    return NULL;
+}
+
+/* checks to see if two lvals are equal */
+int lval_eq(lval* x, lval* y) {
+    /* shared values are trivially equal */
+    if(x == y) {return 1;}
+    
+    /* vectors are equal to lists with the same items */
+    if(ltype(x) == LVAL_VEC || ltype(y) == LVAL_VEC) {
+        int tx = ltype(x), ty = ltype(y);
+        if((tx != LVAL_VEC && tx != LVAL_QEXPR)
+            || (ty != LVAL_VEC && ty != LVAL_QEXPR)) {return 0;}
+        if(x->count != y->count) {return 0;}
+        for(int i = 0; i < x->count; i++) {
+            lval* a = tx == LVAL_VEC ? lvec_nth(x, i) : x->cell[i];
+            lval* b = ty == LVAL_VEC ? lvec_nth(y, i) : y->cell[i];
+            if(!lval_eq(a, b)) {return 0;}
+        }
+        return 1;
+    }
+    
+    /* Different types are always unequal */
+    if(ltype(x) != ltype(y)) {return 0;}
+    
+    /* Compare based upon type */
+    switch(ltype(x)) {
+        case LVAL_NUM: return (lnum(x) == lnum(y));
+        case LVAL_BIG: return lbig_cmp(x->big, y->big) == 0;
+        case LVAL_DBL: return x->dbl == y->dbl;
+        case LVAL_ARR:
+            if(x->count != y->count || x->arr->dbl != y->arr->dbl) {return 0;}
+            for(int i = 0; i < x->count; i++) {
+                if(x->arr->dbl ? x->arr->f[i] != y->arr->f[i]
+                    : x->arr->i[i] != y->arr->i[i]) {return 0;}
+            }
+            return 1;
+        case LVAL_MAT:
+            if(x->mat->rows != y->mat->rows || x->mat->cols != y->mat->cols) {
+                return 0;
+            }
+            for(long i = 0; i < (long)x->mat->rows * x->mat->cols; i++) {
+                if(x->mat->d[i] != y->mat->d[i]) {return 0;}
+            }
+            return 1;
+        
+        case LVAL_ERR: return(strcmp(x->err, y->err) == 0);
+        case LVAL_SYM: return(x->sym == y->sym);
+        case LVAL_STR: return(strcmp(x->str, y->str) == 0);
+        
+        /* compare if builtin, otherwise compare formals and body */
+        case LVAL_FUN:
+            if(lval_builtin(x) || lval_builtin(y)) {
+                return lval_builtin(x) == lval_builtin(y);
+            } else {
+                if(!x->fn->args != !y->fn->args) {return 0;}
+                if(x->fn->args && !lval_eq(x->fn->args, y->fn->args)) {
+                    return 0;
+                }
+                return lval_eq(x->fn->formals, y->fn->formals)
+                    && lval_eq(x->fn->body, y->fn->body);
+            }
+        
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if(x->count != y->count) {return 0;}
+            for(int i = 0; i < x->count; i++) {
+                if(!lval_eq(x->cell[i], y->cell[i])) {return 0;}
+            }
+            /* otherwise lists must be equal */
+            return 1;
+            break;
+    }
+    return 0;
+}
+
+/* wraps the items of a flat list, from off, as a vector */
+lval* lvec_run(lval* base, int off, int n) {
+    lval* v = lval_new(LVAL_VEC);
+    v->vec = lpool_alloc(&gc.vecs);
+    v->vec->left = NULL;
+    v->vec->right = NULL;
+    v->vec->depth = 0;
+    v->vec->base = base;
+    v->vec->off = off;
+    v->count = n;
+    lvec_live++;
+    return v;
+}
+
+/* joins two vectors side by side */
+lval* lvec_node(lval* l, lval* r) {
+    lval* v = lval_new(LVAL_VEC);
+    v->vec = lpool_alloc(&gc.vecs);
+    v->vec->left = l;
+    v->vec->right = r;
+    int dl = l->vec->depth, dr = r->vec->depth;
+    v->vec->depth = 1 + (dl > dr ? dl : dr);
+    v->vec->base = NULL;
+    v->count = l->count + r->count;
+    lvec_live++;
+    return v;
+}
+
+/* turns a q-expression or vector into a vector */
+lval* lvec_from(lval* x) {
+    if(ltype(x) == LVAL_VEC) {return x;}
+    return lvec_run(x, 0, x->count);
+}
+
+/* concatenates two vectors, keeping the tree balanced */
+/* the shallower one is joined onto the side of the deeper one, which */
+/* is then rotated if that made it too deep on one side */
+lval* lvec_cat(lval* a, lval* b) {
+    if(a->count == 0) {lval_del(a); return b;}
+    if(b->count == 0) {lval_del(b); return a;}
+    
+    int da = a->vec->depth, db = b->vec->depth;
+    
+    /* short runs are merged so joining one item at a time stays compact */
+    if(da == 0 && db == 0 && a->count + b->count <= LVEC_RUN) {
+        lval* x = lval_new(LVAL_QEXPR);
+        lval_reserve(x, a->count + b->count);
+        for(int i = 0; i < a->count; i++) {
+            x->cell[x->count++] = lval_copy(a->vec->base->cell[a->vec->off + i]);
+        }
+        for(int i = 0; i < b->count; i++) {
+            x->cell[x->count++] = lval_copy(b->vec->base->cell[b->vec->off + i]);
+        }
+        lval_del(a); lval_del(b);
+        return lvec_run(x, 0, x->count);
+    }
+    
+    if(da > db + 1) {
+        lval* l = lval_copy(a->vec->left);
+        lval* r = lvec_cat(lval_copy(a->vec->right), b);
+        lval_del(a);
+        if(r->vec->depth <= l->vec->depth + 1) {return lvec_node(l, r);}
+        
+        lval* rl = r->vec->left;
+        lval* rr = r->vec->right;
+        lval* x;
+        if(rl->vec->depth > rr->vec->depth) {
+            x = lvec_node(lvec_node(l, lval_copy(rl->vec->left)),
+                lvec_node(lval_copy(rl->vec->right), lval_copy(rr)));
+        } else {
+            x = lvec_node(lvec_node(l, lval_copy(rl)), lval_copy(rr));
+        }
+        lval_del(r);
+        return x;
+    }
+    
+    if(db > da + 1) {
+        lval* l = lvec_cat(a, lval_copy(b->vec->left));
+        lval* r = lval_copy(b->vec->right);
+        lval_del(b);
+        if(l->vec->depth <= r->vec->depth + 1) {return lvec_node(l, r);}
+        
+        lval* ll = l->vec->left;
+        lval* lr = l->vec->right;
+        lval* x;
+        if(lr->vec->depth > ll->vec->depth) {
+            x = lvec_node(lvec_node(lval_copy(ll), lval_copy(lr->vec->left)),
+                lvec_node(lval_copy(lr->vec->right), r));
+        } else {
+            x = lvec_node(lval_copy(ll), lvec_node(lval_copy(lr), r));
+        }
+        lval_del(l);
+        return x;
+    }
+    
+    return lvec_node(a, b);
+}
+
+/* returns n items of v starting at from, sharing everything it can */
+lval* lvec_slice(lval* v, int from, int n) {
+    if(from == 0 && n == v->count) {return lval_copy(v);}
+    if(n == 0) {return lvec_run(lval_qexpr(), 0, 0);}
+    
+    lvec* x = v->vec;
+    if(x->base) {return lvec_run(lval_copy(x->base), x->off + from, n);}
+    
+    int lc = x->left->count;
+    if(from + n <= lc) {return lvec_slice(x->left, from, n);}
+    if(from >= lc) {return lvec_slice(x->right, from - lc, n);}
+    return lvec_cat(lvec_slice(x->left, from, lc - from),
+        lvec_slice(x->right, 0, n - (lc - from)));
+}
+
+/* returns item i of a vector, without taking a reference */
+lval* lvec_nth(lval* v, int i) {
+    while(v->vec->base == NULL) {
+        lval* l = v->vec->left;
+        if(i < l->count) {
+            v = l;
+        } else {
+            i -= l->count;
+            v = v->vec->right;
+        }
+    }
+    return v->vec->base->cell[v->vec->off + i];
+}
+
+/* copies references to the items of a vector into a list */
+void lvec_fill(lval* v, lval* x) {
+    if(v->vec->base) {
+        for(int i = 0; i < v->count; i++) {
+            x->cell[x->count++] = lval_copy(v->vec->base->cell[v->vec->off + i]);
+        }
+    } else {
+        lvec_fill(v->vec->left, x);
+        lvec_fill(v->vec->right, x);
+    }
+}
+
+/* turns a vector back into a flat q-expression */
+lval* lvec_flat(lval* v) {
+    /* a run over a whole list is that list */
+    lvec* x = v->vec;
+    if(x->base && x->off == 0 && v->count == x->base->count) {
+        lval* base = lval_copy(x->base);
+        lval_del(v);
+        return base;
+    }
+    lval* q = lval_new(LVAL_QEXPR);
+    lval_reserve(q, v->count);
+    lvec_fill(v, q);
+    lval_del(v);
+    return q;
+}
+
+/* builtins that don't know about vectors are given flat q-expressions */
+lval* lvec_args(lbuiltin f, lval* a) {
+    if(f == builtin_head || f == builtin_tail || f == builtin_join
+        || f == builtin_eq || f == builtin_ne || f == builtin_print
+        || f == builtin_vec || f == builtin_nth || f == builtin_slice
+        || f == builtin_def || f == builtin_put) {
+        return a;
+    }
+    for(int i = 0; i < a->count; i++) {
+        if(ltype(a->cell[i]) == LVAL_VEC) {a->cell[i] = lvec_flat(a->cell[i]);}
     }
+    return a;
 }
 
-lval* builtin_print(lenv* e, lval* a) {
-
-    /* Print each argument followed by a space */
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]); putchar(' ');
+/* prints the items of a vector separated by spaces */
+void lvec_print(lval* v, int first) {
+    if(v->vec->base) {
+        for(int i = 0; i < v->count; i++) {
+            if(!first || i) {putchar(' ');}
+            lval_print(v->vec->base->cell[v->vec->off + i]);
+        }
+    } else {
+        lvec_print(v->vec->left, first);
+        lvec_print(v->vec->right, 0);
     }
+}
 
-    /* Print a newline and delete arguments */
-    putchar('\n');
-    lval_del(a);
+/* creates a zeroed bignum with room for n limbs */
+lbig* lbig_new(int n) {
+    lbig* b = calloc(1, sizeof(lbig) + sizeof(uint32_t) * (n ? n : 1));
+    b->d = (uint32_t*)(b + 1);
+    b->n = n;
+    return b;
+}
 
-    return lval_sexpr();
+/* copies a bignum */
+lbig* lbig_copy(lbig* b) {
+    lbig* r = lbig_new(b->n);
+    memcpy(r->d, b->d, sizeof(uint32_t) * b->n);
+    r->neg = b->neg;
+    return r;
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* fills in a bignum view of x, using buf for its limbs */
+lbig* lbig_long(lbig* b, uint32_t* buf, long x) {
+    /* negating in unsigned arithmetic works for LONG_MIN too */
+    unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    b->neg = x < 0;
+    b->d = buf;
+    b->n = 0;
+    while(m) {
+        buf[b->n++] = (uint32_t)m;
+        m = m >> 16 >> 16;
+    }
+    return b;
+}
 
-    /* Construct Error from first argument */
-    lval* err = lval_err(a->cell[0]->str);
+/* the bignum value of a number or big number, borrowed or built in buf */
+lbig* lbig_of(lval* x, lbig* b, uint32_t* buf) {
+    if(ltype(x) == LVAL_BIG) {return x->big;}
+    return lbig_long(b, buf, lnum(x));
+}
 
-    /* Delete arguments and return */
-    lval_del(a);
-    return err;
+/* drops leading zero limbs */
+void lbig_trim(lbig* b) {
+    while(b->n && b->d[b->n-1] == 0) {b->n--;}
+    if(b->n == 0) {b->neg = 0;}
 }
 
-/* create a new number type lval */
-lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->num = x;
+/* makes a number from a bignum, boxed as a big number only if it */
+/* doesn't fit in a long */
+lval* lval_big(lbig* b) {
+    lbig_trim(b);
+    if(b->n <= (int)(sizeof(long) / sizeof(uint32_t))) {
+        unsigned long m = 0;
+        for(int i = b->n - 1; i >= 0; i--) {m = (m << 16 << 16) | b->d[i];}
+        if(b->neg ? m <= (unsigned long)LONG_MAX + 1 : m <= LONG_MAX) {
+            long x = b->neg ? (long)(0 - m) : (long)m;
+            free(b);
+            return lval_num(x);
+        }
+    }
+    lval* v = lval_new(LVAL_BIG);
+    v->big = b;
     return v;
 }
 
-/* create a new error type lval */
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+/* compares magnitudes */
+int lmag_cmp(uint32_t* a, int an, uint32_t* b, int bn) {
+    if(an != bn) {return an < bn ? -1 : 1;}
+    for(int i = an - 1; i >= 0; i--) {
+        if(a[i] != b[i]) {return a[i] < b[i] ? -1 : 1;}
+    }
+    return 0;
+}
+
+/* compares two bignums */
+int lbig_cmp(lbig* a, lbig* b) {
+    if(a->neg != b->neg) {return a->neg ? -1 : 1;}
+    int c = lmag_cmp(a->d, a->n, b->d, b->n);
+    return a->neg ? -c : c;
+}
+
+/* adds x into r, carrying as far as needed - r must have room */
+void lmag_add_into(uint32_t* r, uint32_t* x, int xn) {
+    uint64_t c = 0;
+    int i = 0;
+    for(; i < xn; i++) {
+        c += (uint64_t)r[i] + x[i];
+        r[i] = (uint32_t)c;
+        c >>= 32;
+    }
+    for(; c; i++) {
+        c += r[i];
+        r[i] = (uint32_t)c;
+        c >>= 32;
+    }
+}
+
+/* subtracts x from r, which must be at least as large */
+void lmag_sub_into(uint32_t* r, uint32_t* x, int xn) {
+    int64_t borrow = 0;
+    int i = 0;
+    for(; i < xn; i++) {
+        int64_t t = (int64_t)r[i] - x[i] - borrow;
+        r[i] = (uint32_t)t;
+        borrow = t < 0;
+    }
+    for(; borrow; i++) {
+        borrow = r[i] == 0;
+        r[i]--;
+    }
+}
+
+/* adds or subtracts two bignums */
+lbig* lbig_add(lbig* a, lbig* b, int sub) {
+    int bneg = sub ? !b->neg : b->neg;
     
-    /* create a va list and initialize it */
-    va_list va;
-    va_start(va, fmt);
+    /* same signs add magnitudes, otherwise the smaller is taken away */
+    /* from the larger, which gives the sign */
+    if(a->neg == bneg) {
+        lbig* r = lbig_new((a->n > b->n ? a->n : b->n) + 1);
+        memcpy(r->d, a->d, sizeof(uint32_t) * a->n);
+        lmag_add_into(r->d, b->d, b->n);
+        r->neg = a->neg;
+        lbig_trim(r);
+        return r;
+    }
+    int neg = a->neg;
+    if(lmag_cmp(a->d, a->n, b->d, b->n) < 0) {
+        lbig* t = a; a = b; b = t;
+        neg = bneg;
+    }
+    lbig* r = lbig_new(a->n);
+    memcpy(r->d, a->d, sizeof(uint32_t) * a->n);
+    lmag_sub_into(r->d, b->d, b->n);
+    r->neg = neg;
+    lbig_trim(r);
+    return r;
+}
+
+/* multiplies magnitudes into r, which has room for an+bn limbs */
+/* long numbers are split in half so three products do the work of four */
+void lmag_mul(uint32_t* r, uint32_t* a, int an, uint32_t* b, int bn) {
+    if(an < bn) {
+        uint32_t* t = a; a = b; b = t;
+        int tn = an; an = bn; bn = tn;
+    }
+    memset(r, 0, sizeof(uint32_t) * (an + bn));
     
-    /* allocate 512 bytes */
-    v->err = malloc(512);
-    /*print the error string with max of 511 characters */
-    vsnprintf(v->err, 511, fmt, va);
+    /* schoolbook multiplication for short numbers */
+    if(bn < LBIG_KARATSUBA) {
+        for(int i = 0; i < bn; i++) {
+            uint64_t c = 0;
+            for(int j = 0; j < an; j++) {
+                c += (uint64_t)a[j] * b[i] + r[i+j];
+                r[i+j] = (uint32_t)c;
+                c >>= 32;
+            }
+            r[i+an] = (uint32_t)c;
+        }
+        return;
+    }
     
-    /* reallocate to number of bytes actually used */
-    v->err = realloc(v->err, strlen(v->err)+1);
+    int m = an / 2;
     
-    /* clean up our va list */
-    va_end(va);
+    /* b is too short to split, so multiply it by each half of a */
+    if(bn <= m) {
+        lmag_mul(r, a, m, b, bn);
+        uint32_t* t = malloc(sizeof(uint32_t) * (an - m + bn));
+        lmag_mul(t, a + m, an - m, b, bn);
+        lmag_add_into(r + m, t, an - m + bn);
+        free(t);
+        return;
+    }
     
-    return v;
+    /* a*b = z2*B^2m + z1*B^m + z0, where z1 = (a0+a1)(b0+b1) - z2 - z0 */
+    int sn = an - m + 1, tn = (m > bn - m ? m : bn - m) + 1;
+    uint32_t* s = calloc(sn, sizeof(uint32_t));
+    uint32_t* t = calloc(tn, sizeof(uint32_t));
+    uint32_t* z1 = malloc(sizeof(uint32_t) * (sn + tn));
+    uint32_t* z = malloc(sizeof(uint32_t) * (an + bn));
+    
+    memcpy(s, a, sizeof(uint32_t) * m);
+    lmag_add_into(s, a + m, an - m);
+    memcpy(t, b, sizeof(uint32_t) * m);
+    lmag_add_into(t, b + m, bn - m);
+    lmag_mul(z1, s, sn, t, tn);
+    
+    lmag_mul(z, a, m, b, m);
+    memcpy(r, z, sizeof(uint32_t) * 2 * m);
+    lmag_sub_into(z1, z, 2 * m);
+    lmag_mul(z, a + m, an - m, b + m, bn - m);
+    memcpy(r + 2 * m, z, sizeof(uint32_t) * (an + bn - 2 * m));
+    lmag_sub_into(z1, z, an + bn - 2 * m);
+    
+    int zn = sn + tn;
+    while(zn && z1[zn-1] == 0) {zn--;}
+    lmag_add_into(r + m, z1, zn);
+    
+    free(s); free(t); free(z1); free(z);
 }
 
-/* construct a pointer to a new symbol lval */
-lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
+/* multiplies two bignums */
+lbig* lbig_mul(lbig* a, lbig* b) {
+    lbig* r = lbig_new(a->n + b->n);
+    if(a->n && b->n) {lmag_mul(r->d, a->d, a->n, b->d, b->n);}
+    r->neg = a->neg != b->neg;
+    lbig_trim(r);
+    return r;
 }
 
-/* construct a pointer to a new empty Sexpr lval */
-lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+/* divides bignums, truncating like C, returning the quotient */
+/* or the remainder - b must not be zero */
+lbig* lbig_div(lbig* a, lbig* b, int mod) {
+    int m = a->n, n = b->n;
+    lbig* q = lbig_new(m >= n ? m - n + 1 : 1);
+    lbig* r = lbig_new(n);
+    
+    if(m < n) {
+        memcpy(r->d, a->d, sizeof(uint32_t) * m);
+    } else if(n == 1) {
+        /* short division by a single limb */
+        uint64_t rem = 0;
+        for(int i = m - 1; i >= 0; i--) {
+            uint64_t cur = (rem << 32) | a->d[i];
+            q->d[i] = (uint32_t)(cur / b->d[0]);
+            rem = cur % b->d[0];
+        }
+        r->d[0] = (uint32_t)rem;
+    } else {
+        /* long division, Knuth's algorithm D - normalise so the top */
+        /* limb of the divisor has its high bit set, then estimate each */
+        /* quotient limb from the top two limbs and correct it */
+        int sh = __builtin_clz(b->d[n-1]);
+        uint32_t* vn = malloc(sizeof(uint32_t) * n);
+        uint32_t* un = malloc(sizeof(uint32_t) * (m + 1));
+        for(int i = n - 1; i > 0; i--) {
+            vn[i] = (b->d[i] << sh) | (uint32_t)((uint64_t)b->d[i-1] >> (32 - sh));
+        }
+        vn[0] = b->d[0] << sh;
+        un[m] = (uint32_t)((uint64_t)a->d[m-1] >> (32 - sh));
+        for(int i = m - 1; i > 0; i--) {
+            un[i] = (a->d[i] << sh) | (uint32_t)((uint64_t)a->d[i-1] >> (32 - sh));
+        }
+        un[0] = a->d[0] << sh;
+        
+        for(int j = m - n; j >= 0; j--) {
+            uint64_t num = ((uint64_t)un[j+n] << 32) | un[j+n-1];
+            uint64_t qhat = num / vn[n-1];
+            uint64_t rhat = num % vn[n-1];
+            while(qhat >> 32
+                || qhat * vn[n-2] > ((rhat << 32) | un[j+n-2])) {
+                qhat--;
+                rhat += vn[n-1];
+                if(rhat >> 32) {break;}
+            }
+            
+            /* multiply and subtract */
+            int64_t borrow = 0, t;
+            for(int i = 0; i < n; i++) {
+                uint64_t p = qhat * vn[i];
+                t = (int64_t)un[i+j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+                un[i+j] = (uint32_t)t;
+                borrow = (int64_t)(p >> 32) - (t >> 32);
+            }
+            t = (int64_t)un[j+n] - borrow;
+            un[j+n] = (uint32_t)t;
+            
+            /* the estimate was one too big, add the divisor back */
+            q->d[j] = (uint32_t)qhat;
+            if(t < 0) {
+                q->d[j]--;
+                uint64_t c = 0;
+                for(int i = 0; i < n; i++) {
+                    c += (uint64_t)un[i+j] + vn[i];
+                    un[i+j] = (uint32_t)c;
+                    c >>= 32;
+                }
+                un[j+n] += (uint32_t)c;
+            }
+        }
+        
+        for(int i = 0; i < n; i++) {
+            r->d[i] = (un[i] >> sh) | (uint32_t)((uint64_t)un[i+1] << (32 - sh));
+        }
+        free(vn); free(un);
+    }
+    
+    q->neg = a->neg != b->neg;
+    r->neg = a->neg;
+    lbig_trim(q);
+    lbig_trim(r);
+    if(mod) {free(q); return r;}
+    free(r);
+    return q;
 }
 
-/* construct a pointer to a new empty Qexpr lval */
-lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+/* raises a bignum to a non-negative power by repeated squaring */
+lbig* lbig_pow(lbig* a, unsigned long e) {
+    lbig* r = lbig_new(1);
+    r->d[0] = 1;
+    lbig* x = lbig_mul(a, r);
+    while(e) {
+        if(e & 1) {
+            lbig* t = lbig_mul(r, x);
+            free(r);
+            r = t;
+        }
+        e >>= 1;
+        if(e) {
+            lbig* t = lbig_mul(x, x);
+            free(x);
+            x = t;
+        }
+    }
+    free(x);
+    return r;
 }
 
-/* construct a pointer to a new function */
-lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin = func;
-    return v;
+/* raises x to a non-negative power by repeated squaring, returning 0 */
+/* if the result doesn't fit in a long */
+int lpow_long(long x, long e, long* r) {
+    long acc = 1;
+    while(e) {
+        if((e & 1) && __builtin_mul_overflow(acc, x, &acc)) {return 0;}
+        e >>= 1;
+        if(e && __builtin_mul_overflow(x, x, &x)) {return 0;}
+    }
+    *r = acc;
+    return 1;
 }
 
-/* constructor for user defined functions */
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+/* reads a bignum from a string of decimal digits, with an optional '-' */
+lbig* lbig_read(char* s) {
+    int neg = *s == '-';
+    if(neg) {s++;}
     
-    /* set builtin to null */
-    v->builtin = NULL;
+    /* each limb holds a little over nine digits */
+    lbig* b = lbig_new(strlen(s) / 9 + 2);
+    b->n = 0;
+    while(*s) {
+        /* multiply by 10^k and add the next k digits */
+        uint32_t chunk = 0, scale = 1;
+        for(int k = 0; k < 9 && *s; k++, s++) {
+            chunk = chunk * 10 + (*s - '0');
+            scale *= 10;
+        }
+        uint64_t c = chunk;
+        for(int i = 0; i < b->n; i++) {
+            c += (uint64_t)b->d[i] * scale;
+            b->d[i] = (uint32_t)c;
+            c >>= 32;
+        }
+        if(c) {b->d[b->n++] = (uint32_t)c;}
+    }
+    b->neg = neg;
+    lbig_trim(b);
+    return b;
+}
+
+/* prints a bignum in decimal, nine digits at a time */
+void lbig_print(lbig* b) {
+    uint32_t* m = malloc(sizeof(uint32_t) * (b->n ? b->n : 1));
+    memcpy(m, b->d, sizeof(uint32_t) * b->n);
+    int n = b->n;
     
-    /* build new environment */
-    v->env = lenv_new();
+    /* peel off the low nine digits by dividing by a billion */
+    uint32_t* parts = malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+    int np = 0;
+    while(n) {
+        uint64_t rem = 0;
+        for(int i = n - 1; i >= 0; i--) {
+            uint64_t cur = (rem << 32) | m[i];
+            m[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        parts[np++] = (uint32_t)rem;
+        while(n && m[n-1] == 0) {n--;}
+    }
     
-    /* set formals and body */
-    v->formals = formals;
-    v->body = body;
-    return v;
+    if(b->neg) {putchar('-');}
+    if(np == 0) {putchar('0');}
+    for(int i = np - 1; i >= 0; i--) {
+        printf(i == np - 1 ? "%u" : "%09u", parts[i]);
+    }
+    free(m);
+    free(parts);
 }
 
-/* constructor for string lvals */
-lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+/* creates an array of n numbers, integers or decimals */
+lval* lval_arr(int dbl, int n) {
+    larr* x = malloc(sizeof(larr) + sizeof(double) * (n ? n : 1));
+    x->dbl = dbl;
+    x->i = (int64_t*)(x + 1);
+    lval* v = lval_new(LVAL_ARR);
+    v->arr = x;
+    v->count = n;
     return v;
 }
 
-lval* lval_exit() {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_EXIT;
+/* turns a number or array into an array of the given kind and length, */
+/* a number being repeated to fill it */
+lval* larr_as(lval* x, int dbl, int n) {
+    if(ltype(x) == LVAL_ARR && x->arr->dbl == dbl) {return x;}
+    
+    lval* v = lval_arr(dbl, n);
+    if(ltype(x) == LVAL_ARR) {
+        /* only integers are ever promoted */
+        for(int i = 0; i < n; i++) {v->arr->f[i] = (double)x->arr->i[i];}
+    } else if(dbl) {
+        double d = ldbl(x);
+        for(int i = 0; i < n; i++) {v->arr->f[i] = d;}
+    } else {
+        int64_t k = lnum(x);
+        for(int i = 0; i < n; i++) {v->arr->i[i] = k;}
+    }
+    lval_del(x);
     return v;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ?
-        lval_num(x) : lval_err("invalid number");
+/* SIMD kernels - each does as much as it can a vector at a time and */
+/* returns how far it got, leaving the last few items to a plain loop */
+#ifdef LARR_SIMD
+#define LARR_AVX2 __attribute__((target("avx2")))
+
+/* applies vop to each pair of vectors in a and b */
+#define LARR_MAP(w, vload, vstore, vop) \
+    for(; i + w <= n; i += w) {vstore(r + i, vop(vload(a + i), vload(b + i)));}
+
+LARR_AVX2 static inline __m256i lload4(int64_t* p) {
+    return _mm256_loadu_si256((__m256i*)p);
+}
+LARR_AVX2 static inline void lstore4(int64_t* p, __m256i x) {
+    _mm256_storeu_si256((__m256i*)p, x);
+}
+static inline __m128i lload2(int64_t* p) {
+    return _mm_loadu_si128((__m128i*)p);
+}
+static inline void lstore2(int64_t* p, __m128i x) {
+    _mm_storeu_si128((__m128i*)p, x);
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-    /* cut off the final quote character */
-    t->contents[strlen(t->contents)-1] = '\0';
-    /* copy the string missing out the first quote character */
-    char* unescaped = malloc(strlen(t->contents+1)+1);
-    strcpy(unescaped, t->contents+1);
-    /* pass through the unescape function */
-    unescaped = mpcf_unescape(unescaped);
-    /*construct a new lval using the string */
-    lval* str = lval_str(unescaped);
-    /* free the string and return */
-    free(unescaped);
-    return str;
+LARR_AVX2 long larr_map_f_avx2(int op, double* r, double* a, double* b, long n) {
+    long i = 0;
+    switch(op) {
+        case LOP_ADD: LARR_MAP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd); break;
+        case LOP_SUB: LARR_MAP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd); break;
+        case LOP_MUL: LARR_MAP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd); break;
+        case LOP_DIV: LARR_MAP(4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd); break;
+    }
+    return i;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-    /* if symbol or number return conversion to that type */
-    if (strstr(t->tag, "number")) {return lval_read_num(t);}
-    if (strstr(t->tag, "symbol")) {return lval_sym(t->contents);}
-    if (strstr(t->tag, "string")) {return lval_read_str(t);}
-    
-    /* if root (>) or sexpr then create empty list */
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) {x = lval_sexpr();}
-    if(strstr(t->tag, "sexpr")) {x = lval_sexpr();}
-    if (strstr(t->tag, "qexpr")) {x = lval_qexpr();}
-    
-    /*fill this list with valid expression contained within */
-    for(int i = 0; i < t->children_num; i++) {
-        if(strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if(strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if(strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if(strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if(strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        if(strstr(t->children[i]->tag, "comment")) {continue;}
-        x = lval_add(x, lval_read(t->children[i]));
+long larr_map_f_sse2(int op, double* r, double* a, double* b, long n) {
+    long i = 0;
+    switch(op) {
+        case LOP_ADD: LARR_MAP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd); break;
+        case LOP_SUB: LARR_MAP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd); break;
+        case LOP_MUL: LARR_MAP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd); break;
+        case LOP_DIV: LARR_MAP(2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd); break;
     }
-    return x;
+    return i;
 }
 
-lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
-    return v;
+/* there is no vector instruction for 64 bit multiply or divide */
+LARR_AVX2 long larr_map_i_avx2(int op, int64_t* r, int64_t* a, int64_t* b, long n) {
+    long i = 0;
+    switch(op) {
+        case LOP_ADD: LARR_MAP(4, lload4, lstore4, _mm256_add_epi64); break;
+        case LOP_SUB: LARR_MAP(4, lload4, lstore4, _mm256_sub_epi64); break;
+    }
+    return i;
 }
 
-/* removes and returns a child element of an s-expression */
-lval* lval_pop(lval* v, int i) {
-    /* find the item at "i" */
-    lval* x = v->cell[i];
-    
-    /* shift memory after the item at "i" over the top */
-    memmove(&v->cell[i], &v->cell[i+1],
-        sizeof(lval*) * (v->count-i-1));
-        
-    /* decrease the count of items in the list */
-    v->count--;
-    
-    /* reallocate the memory used */
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+long larr_map_i_sse2(int op, int64_t* r, int64_t* a, int64_t* b, long n) {
+    long i = 0;
+    switch(op) {
+        case LOP_ADD: LARR_MAP(2, lload2, lstore2, _mm_add_epi64); break;
+        case LOP_SUB: LARR_MAP(2, lload2, lstore2, _mm_sub_epi64); break;
+    }
+    return i;
 }
 
-/* returns one element of an s-expression and frees the rest */
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+/* comparisons give all ones or all zeros in each lane, shifted down to 1 or 0 */
+LARR_AVX2 long larr_ord_f_avx2(int op, int64_t* r, double* a, double* b, long n) {
+    long i = 0;
+    for(; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i), y = _mm256_loadu_pd(b + i), m;
+        switch(op) {
+            case LOP_GT: m = _mm256_cmp_pd(x, y, _CMP_GT_OQ); break;
+            case LOP_LT: m = _mm256_cmp_pd(x, y, _CMP_LT_OQ); break;
+            case LOP_GE: m = _mm256_cmp_pd(x, y, _CMP_GE_OQ); break;
+            default: m = _mm256_cmp_pd(x, y, _CMP_LE_OQ); break;
+        }
+        lstore4(r + i, _mm256_srli_epi64(_mm256_castpd_si256(m), 63));
+    }
+    return i;
 }
 
-/* joins one q-expression to another */
-lval* lval_join(lval* x, lval* y) {
-    /* for each cell in 'y' add it to 'x' */
-    while(y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+long larr_ord_f_sse2(int op, int64_t* r, double* a, double* b, long n) {
+    long i = 0;
+    for(; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i), y = _mm_loadu_pd(b + i), m;
+        switch(op) {
+            case LOP_GT: m = _mm_cmpgt_pd(x, y); break;
+            case LOP_LT: m = _mm_cmplt_pd(x, y); break;
+            case LOP_GE: m = _mm_cmpge_pd(x, y); break;
+            default: m = _mm_cmple_pd(x, y); break;
+        }
+        lstore2(r + i, _mm_srli_epi64(_mm_castpd_si128(m), 63));
     }
-    
-    /* delete the empty 'y' and return 'x' */
-    lval_del(y);
-    return x;
+    return i;
 }
 
-/* creates a copy of an lval */
-lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
-    
-    switch(v->type) {
-        /* copy functions and numbers directly */
-        case LVAL_FUN: 
-            if(v->builtin) {
-                x->builtin = v->builtin;
-            } else {
-                x->builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
+/* only a greater than test exists, the rest are made from it */
+LARR_AVX2 long larr_ord_i_avx2(int op, int64_t* r, int64_t* a, int64_t* b, long n) {
+    long i = 0;
+    __m256i one = _mm256_set1_epi64x(1);
+    for(; i + 4 <= n; i += 4) {
+        __m256i x = lload4(a + i), y = lload4(b + i), m;
+        switch(op) {
+            case LOP_GT: m = _mm256_and_si256(_mm256_cmpgt_epi64(x, y), one); break;
+            case LOP_LT: m = _mm256_and_si256(_mm256_cmpgt_epi64(y, x), one); break;
+            case LOP_GE: m = _mm256_andnot_si256(_mm256_cmpgt_epi64(y, x), one); break;
+            default: m = _mm256_andnot_si256(_mm256_cmpgt_epi64(x, y), one); break;
+        }
+        lstore4(r + i, m);
+    }
+    return i;
+}
+
+/* reductions keep a vector of partial results and combine them at the end */
+LARR_AVX2 double larr_fold_f_avx2(int op, double* a, double* b, long n, long* done) {
+    long i = 0;
+    __m256d acc;
+    double t[4];
+    switch(op) {
+        case LARR_SUM:
+            acc = _mm256_setzero_pd();
+            for(; i + 4 <= n; i += 4) {acc = _mm256_add_pd(acc, _mm256_loadu_pd(a + i));}
+            break;
+        case LARR_DOT:
+            acc = _mm256_setzero_pd();
+            for(; i + 4 <= n; i += 4) {
+                acc = _mm256_add_pd(acc,
+                    _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
             }
- 
             break;
-        case LVAL_NUM: x->num = v->num; break;
-        
-        /* copy strings using malloc and strcpy */
-        case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err); break;
-            
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym); break;
-            
-        case LVAL_STR:
-            x->str = malloc(strlen(v->str) + 1);
-            strcpy(x->str, v->str);
+        case LARR_MIN:
+            acc = _mm256_set1_pd(a[0]);
+            for(; i + 4 <= n; i += 4) {acc = _mm256_min_pd(acc, _mm256_loadu_pd(a + i));}
             break;
-            
-        /* copy lists by copying each sub-expression */
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for(int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+        default:
+            acc = _mm256_set1_pd(a[0]);
+            for(; i + 4 <= n; i += 4) {acc = _mm256_max_pd(acc, _mm256_loadu_pd(a + i));}
+            break;
+    }
+    _mm256_storeu_pd(t, acc);
+    *done = i;
+    return larr_combine_f(op, larr_combine_f(op, t[0], t[1]),
+        larr_combine_f(op, t[2], t[3]));
+}
+
+double larr_fold_f_sse2(int op, double* a, double* b, long n, long* done) {
+    long i = 0;
+    __m128d acc;
+    double t[2];
+    switch(op) {
+        case LARR_SUM:
+            acc = _mm_setzero_pd();
+            for(; i + 2 <= n; i += 2) {acc = _mm_add_pd(acc, _mm_loadu_pd(a + i));}
+            break;
+        case LARR_DOT:
+            acc = _mm_setzero_pd();
+            for(; i + 2 <= n; i += 2) {
+                acc = _mm_add_pd(acc, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
             }
             break;
-        case LVAL_EXIT: break;
+        case LARR_MIN:
+            acc = _mm_set1_pd(a[0]);
+            for(; i + 2 <= n; i += 2) {acc = _mm_min_pd(acc, _mm_loadu_pd(a + i));}
+            break;
+        default:
+            acc = _mm_set1_pd(a[0]);
+            for(; i + 2 <= n; i += 2) {acc = _mm_max_pd(acc, _mm_loadu_pd(a + i));}
+            break;
     }
-    return x;
+    _mm_storeu_pd(t, acc);
+    *done = i;
+    return larr_combine_f(op, t[0], t[1]);
+}
+
+/* integer sums wrap like C, min and max are picked with a blend */
+LARR_AVX2 int64_t larr_fold_i_avx2(int op, int64_t* a, long n, long* done) {
+    long i = 0;
+    __m256i acc;
+    int64_t t[4];
+    switch(op) {
+        case LARR_SUM:
+            acc = _mm256_setzero_si256();
+            for(; i + 4 <= n; i += 4) {acc = _mm256_add_epi64(acc, lload4(a + i));}
+            break;
+        case LARR_MIN:
+            acc = _mm256_set1_epi64x(a[0]);
+            for(; i + 4 <= n; i += 4) {
+                __m256i x = lload4(a + i);
+                acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(acc, x));
+            }
+            break;
+        default:
+            acc = _mm256_set1_epi64x(a[0]);
+            for(; i + 4 <= n; i += 4) {
+                __m256i x = lload4(a + i);
+                acc = _mm256_blendv_epi8(acc, x, _mm256_cmpgt_epi64(x, acc));
+            }
+            break;
+    }
+    lstore4(t, acc);
+    *done = i;
+    return larr_combine_i(op, larr_combine_i(op, t[0], t[1]),
+        larr_combine_i(op, t[2], t[3]));
 }
 
+/* adds a times x to y - the inner loop of matrix multiply */
+LARR_AVX2 long larr_axpy_avx2(double* y, double a, double* x, long n) {
+    long i = 0;
+    __m256d va = _mm256_set1_pd(a);
+    for(; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i),
+            _mm256_mul_pd(va, _mm256_loadu_pd(x + i))));
+    }
+    return i;
+}
 
-/* calls a function */
-lval* lval_call(lenv* e, lval* f, lval* a) {
+long larr_axpy_sse2(double* y, double a, double* x, long n) {
+    long i = 0;
+    __m128d va = _mm_set1_pd(a);
+    for(; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i),
+            _mm_mul_pd(va, _mm_loadu_pd(x + i))));
+    }
+    return i;
+}
+#endif
 
-    /* If Builtin then simply apply that */
-    if (f->builtin) { return f->builtin(e, a); }
+/* combines two partial results of a reduction */
+double larr_combine_f(int op, double x, double y) {
+    switch(op) {
+        case LARR_MIN: return y < x ? y : x;
+        case LARR_MAX: return y > x ? y : x;
+        default: return x + y;
+    }
+}
 
-    /* Record Argument Counts */
-    int given = a->count;
-    int total = f->formals->count;
+int64_t larr_combine_i(int op, int64_t x, int64_t y) {
+    switch(op) {
+        case LARR_MIN: return y < x ? y : x;
+        case LARR_MAX: return y > x ? y : x;
+        default: return (int64_t)((uint64_t)x + (uint64_t)y);
+    }
+}
 
-    /* While arguments still remain to be processed */
-    while (a->count) {
+/* adds a times x to y */
+void larr_axpy(double* y, double a, double* x, long n) {
+    long i = 0;
+#ifdef LARR_SIMD
+    i = larr_avx2 ? larr_axpy_avx2(y, a, x, n) : larr_axpy_sse2(y, a, x, n);
+#endif
+    for(; i < n; i++) {y[i] += a * x[i];}
+}
 
-        /* If we've ran out of formal arguments to bind */
-        if (f->formals->count == 0) {
-            lval_del(a); return lval_err(
-                "Function passed too many arguments. "
-                "Got %i, Expected %i.", given, total); 
+/* applies + - * or / to each pair of items, r may be a or b */
+/* returns 0 if a division by zero was found */
+int larr_map(int op, larr* r, larr* a, larr* b, long n) {
+    long i = 0;
+    if(r->dbl) {
+        /* checked first, as decimals would give inf rather than stopping */
+        if(op == LOP_DIV) {
+            for(long j = 0; j < n; j++) {
+                if(b->f[j] == 0) {return 0;}
+            }
+        }
+#ifdef LARR_SIMD
+        i = larr_avx2 ? larr_map_f_avx2(op, r->f, a->f, b->f, n)
+            : larr_map_f_sse2(op, r->f, a->f, b->f, n);
+#endif
+        for(; i < n; i++) {
+            switch(op) {
+                case LOP_ADD: r->f[i] = a->f[i] + b->f[i]; break;
+                case LOP_SUB: r->f[i] = a->f[i] - b->f[i]; break;
+                case LOP_MUL: r->f[i] = a->f[i] * b->f[i]; break;
+                case LOP_DIV: r->f[i] = a->f[i] / b->f[i]; break;
+            }
         }
-
-        /* Pop the first symbol from the formals */
-        lval* sym = lval_pop(f->formals, 0);
-        
-        /* Special Case to deal with '&' */
-        if (strcmp(sym->sym, "&") == 0) {
-          
-            /* Ensure '&' is followed by another symbol */
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("Function format invalid. "
-                    "Symbol '&' not followed by single symbol.");
+        return 1;
+    }
+    
+#ifdef LARR_SIMD
+    i = larr_avx2 ? larr_map_i_avx2(op, r->i, a->i, b->i, n)
+        : larr_map_i_sse2(op, r->i, a->i, b->i, n);
+#endif
+    /* integers wrap around rather than overflowing */
+    uint64_t* ur = (uint64_t*)r->i;
+    uint64_t* ua = (uint64_t*)a->i;
+    uint64_t* ub = (uint64_t*)b->i;
+    switch(op) {
+        case LOP_ADD: for(; i < n; i++) {ur[i] = ua[i] + ub[i];} break;
+        case LOP_SUB: for(; i < n; i++) {ur[i] = ua[i] - ub[i];} break;
+        case LOP_MUL: for(; i < n; i++) {ur[i] = ua[i] * ub[i];} break;
+        case LOP_DIV:
+            for(; i < n; i++) {
+                if(b->i[i] == 0) {return 0;}
+                r->i[i] = b->i[i] == -1 ? (int64_t)(0 - ua[i]) : a->i[i] / b->i[i];
             }
-          
-            /* Next formal should be bound to remaining arguments */
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym); lval_del(nsym);
             break;
-        }
-
-        /* Pop the next argument from the list */
-        lval* val = lval_pop(a, 0);
-
-        /* Bind a copy into the function's environment */
-        lenv_put(f->env, sym, val);
-
-        /* Delete symbol and value */
-        lval_del(sym); lval_del(val);
     }
+    return 1;
+}
 
-    /* Argument list is now bound so can be cleaned up */
-    lval_del(a);
+/* compares each pair of items, giving 1 or 0 for each in r */
+void larr_ord(int op, int64_t* r, larr* a, larr* b, long n) {
+    long i = 0;
+    if(a->dbl) {
+#ifdef LARR_SIMD
+        i = larr_avx2 ? larr_ord_f_avx2(op, r, a->f, b->f, n)
+            : larr_ord_f_sse2(op, r, a->f, b->f, n);
+#endif
+        for(; i < n; i++) {
+            double x = a->f[i], y = b->f[i];
+            switch(op) {
+                case LOP_GT: r[i] = x > y; break;
+                case LOP_LT: r[i] = x < y; break;
+                case LOP_GE: r[i] = x >= y; break;
+                case LOP_LE: r[i] = x <= y; break;
+            }
+        }
+        return;
+    }
     
-    /* If '&' remains in formal list bind to empty list */
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        
-        /* Check to ensure that & is not passed invalidly. */
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid. "
-                "Symbol '&' not followed by single symbol.");
+#ifdef LARR_SIMD
+    if(larr_avx2) {i = larr_ord_i_avx2(op, r, a->i, b->i, n);}
+#endif
+    for(; i < n; i++) {
+        int64_t x = a->i[i], y = b->i[i];
+        switch(op) {
+            case LOP_GT: r[i] = x > y; break;
+            case LOP_LT: r[i] = x < y; break;
+            case LOP_GE: r[i] = x >= y; break;
+            case LOP_LE: r[i] = x <= y; break;
         }
-        
-        /* Pop and delete '&' symbol */
-        lval_del(lval_pop(f->formals, 0));
-        
-        /* Pop next symbol and create empty list */
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
-        
-        /* Bind to environment and delete */
-        lenv_put(f->env, sym, val);
-        lval_del(sym); lval_del(val);
     }
+}
 
-    /* If all formals have been bound evaluate */
-    if (f->formals->count == 0) {
+/* reduces an array to its sum, minimum, maximum, or dot product with b */
+lval* larr_fold(int op, larr* a, larr* b, long n) {
+    long i = 0;
+    if(a->dbl) {
+        double x = op == LARR_MIN || op == LARR_MAX ? a->f[0] : 0;
+#ifdef LARR_SIMD
+        x = larr_avx2 ? larr_fold_f_avx2(op, a->f, b ? b->f : NULL, n, &i)
+            : larr_fold_f_sse2(op, a->f, b ? b->f : NULL, n, &i);
+#endif
+        for(; i < n; i++) {
+            x = larr_combine_f(op, x, op == LARR_DOT ? a->f[i] * b->f[i] : a->f[i]);
+        }
+        return lval_dbl(x);
+    }
+    
+    int64_t x = op == LARR_MIN || op == LARR_MAX ? a->i[0] : 0;
+#ifdef LARR_SIMD
+    if(larr_avx2 && op != LARR_DOT) {x = larr_fold_i_avx2(op, a->i, n, &i);}
+#endif
+    for(; i < n; i++) {
+        x = larr_combine_i(op, x, op == LARR_DOT
+            ? (int64_t)((uint64_t)a->i[i] * (uint64_t)b->i[i]) : a->i[i]);
+    }
+    return lval_num(x);
+}
 
-        /* Set environment parent to evaluation environment */
-        f->env->par = e;
+/* creates a zeroed rows by cols matrix */
+lval* lval_mat(int rows, int cols) {
+    lmat* m = calloc(1, sizeof(lmat) + sizeof(double) * ((long)rows * cols + 1));
+    m->rows = rows;
+    m->cols = cols;
+    m->d = (double*)(m + 1);
+    lval* v = lval_new(LVAL_MAT);
+    v->mat = m;
+    v->count = rows;
+    return v;
+}
 
-        /* Evaluate and return */
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        /* Otherwise return partially evaluated function */
-        return lval_copy(f);
+/* multiplies a by b into c, which must be zeroed */
+/* works a block at a time so the rows of b in use stay in cache, and */
+/* adds whole rows of b scaled by an item of a, which vectorizes */
+void lmat_mul(lmat* c, lmat* a, lmat* b) {
+    int n = a->rows, m = a->cols, p = b->cols;
+    for(int i0 = 0; i0 < n; i0 += LMAT_BLOCK) {
+        int i1 = i0 + LMAT_BLOCK < n ? i0 + LMAT_BLOCK : n;
+        for(int k0 = 0; k0 < m; k0 += LMAT_BLOCK) {
+            int k1 = k0 + LMAT_BLOCK < m ? k0 + LMAT_BLOCK : m;
+            for(int j0 = 0; j0 < p; j0 += LMAT_BLOCK) {
+                int jn = (j0 + LMAT_BLOCK < p ? j0 + LMAT_BLOCK : p) - j0;
+                for(int i = i0; i < i1; i++) {
+                    double* crow = c->d + (long)i * p + j0;
+                    for(int k = k0; k < k1; k++) {
+                        larr_axpy(crow, a->d[(long)i * m + k],
+                            b->d + (long)k * p + j0, jn);
+                    }
+                }
+            }
+        }
     }
+}
 
+/* transposes a into t a block at a time, so neither side is read or */
+/* written a whole column at a time */
+void lmat_transpose(lmat* t, lmat* a) {
+    int n = a->rows, m = a->cols;
+    for(int i0 = 0; i0 < n; i0 += LMAT_BLOCK) {
+        int i1 = i0 + LMAT_BLOCK < n ? i0 + LMAT_BLOCK : n;
+        for(int j0 = 0; j0 < m; j0 += LMAT_BLOCK) {
+            int j1 = j0 + LMAT_BLOCK < m ? j0 + LMAT_BLOCK : m;
+            for(int i = i0; i < i1; i++) {
+                for(int j = j0; j < j1; j++) {
+                    t->d[(long)j * n + i] = a->d[(long)i * m + j];
+                }
+            }
+        }
+    }
 }
 
-/* checks to see if two lvals are equal */
-int lval_eq(lval* x, lval* y) {
-    /* Different types are always unequal */
-    if(x->type != y->type) {return 0;}
+/* drops a reference to an lval, the last one hands it to the collector */
+void lval_del(lval* v) {
+    /* only the last owner frees anything, immediates are never freed */
+    if(LVAL_IMM(v) || --v->refs > 0) {return;}
     
-    /* Compare based upon type */
-    switch(x->type) {
-        case LVAL_NUM: return (x->num == y->num);
-        
-        case LVAL_ERR: return(strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return(strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return(strcmp(x->str, y->str) == 0);
-        
-        /* compare if builtin, otherwise compare formals and body */
-        case LVAL_FUN:
-            if(x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
+    /* a short list, like the arguments to a call, lets go now of items */
+    /* that others share, so one left with one owner can be changed - */
+    /* nothing is freed here, the rest wait for gc_step */
+    if((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+        && v->count <= LVAL_INLINE) {
+        int n = 0;
+        for(int i = 0; i < v->count; i++) {
+            lval* x = v->cell[i];
+            if(!LVAL_IMM(x) && x->refs > 1) {
+                x->refs--;
             } else {
-                return lval_eq(x->formals, y->formals)
-                    && lval_eq(x->body, y->body);
-            }
-        
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if(x->count != y->count) {return 0;}
-            for(int i = 0; i < x->count; i++) {
-                if(!lval_eq(x->cell[i], y->cell[i])) {return 0;}
+                v->cell[n++] = x;
             }
-            /* otherwise lists must be equal */
-            return 1;
-            break;
+        }
+        v->count = n;
+    }
+    
+    /* freeing a big structure at once would stall evaluation, so it is */
+    /* freed by gc_step a piece at a time */
+    if(gc.ndead_vals == gc.dead_vals_cap) {
+        gc.dead_vals_cap = gc.dead_vals_cap ? gc.dead_vals_cap * 2 : 1024;
+        gc.dead_vals = realloc(gc.dead_vals, sizeof(lval*) * gc.dead_vals_cap);
+    }
+    gc.dead_vals[gc.ndead_vals++] = v;
+    gc.dead_work++;
+    if(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        gc.dead_work += v->count;
     }
-    return 0;
 }
 
-/* frees all allocated memory associated with an lval */
-void lval_del(lval* v) {
+/* frees all allocated memory associated with a dead lval */
+/* returns the work done, one for it and one for each reference dropped */
+long lval_release(lval* v) {
+    long work = 1;
+    
     /* check which type it is */
     switch(v->type) {
         /*do nothing special for number type */
         case LVAL_NUM: break;
         
-        /* for err or sym, free the string data */
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break;
+        /* strings are freed with the lval itself */
+        case LVAL_ERR: break;
+        case LVAL_SYM: break;
+        case LVAL_STR: break;
         case LVAL_FUN: 
-            if(!v->builtin){
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
-            }
+            /* the global environment's references aren't counted */
+            if(v->fn->env->par) {lenv_del(v->fn->env);}
+            lval_del(v->fn->formals);
+            lval_del(v->fn->body);
+            if(v->fn->args) {lval_del(v->fn->args);}
             break;
         
         /* if Sexpr/Qexpr then delete all elements inside */
@@ -1079,21 +5223,90 @@ void lval_del(lval* v) {
             for(int i = 0; i< v->count; i++) {
                 lval_del(v->cell[i]);
             }
-            /* also free the memory allocated to contain the pointers */
-            free(v->cell);
+            work += v->count;
         break;
         case LVAL_EXIT: break;
+        case LVAL_VEC:
+            if(v->vec->base) {
+                lval_del(v->vec->base);
+            } else {
+                lval_del(v->vec->left);
+                lval_del(v->vec->right);
+            }
+            break;
+    }
+    lval_free(v);
+    return work;
+}
+
+/* frees the memory owned by an lval itself, but not what it points to */
+void lval_free(lval* v) {
+    switch(v->type) {
+        case LVAL_ERR: free(v->err); break;
+        case LVAL_STR: free(v->str); break;
+        case LVAL_BIG: free(v->big); break;
+        case LVAL_ARR: free(v->arr); break;
+        case LVAL_MAT: free(v->mat); break;
+        case LVAL_FUN:
+            lcode_del(v->fn->code);
+            lpool_free(&gc.funcs, v->fn);
+            break;
+        case LVAL_VEC:
+            lpool_free(&gc.vecs, v->vec);
+            lvec_live--;
+            break;
+        /* also free the memory allocated to contain the pointers */
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if(v->cell - LLIST(v)->start != LLIST(v)->inl) {
+                lslab_free(v->cell - LLIST(v)->start, LLIST(v)->cap);
+            }
+            v->refs = 0;
+            lpool_free(&gc.lists, v);
+            return;
     }
-    /* free memory allocated for "lval" itself */
-    free(v);
+    /* return the "lval" itself to the pool */
+    v->refs = 0;
+    lpool_free(&gc.vals, v);
 }
 
 /* print an "lval" */
 void lval_print(lval* v) {
-    switch (v->type) {
+    switch (ltype(v)) {
         /* if it is a number */
         case LVAL_NUM: 
-            printf("%li", v->num); 
+            printf("%li", lnum(v)); 
+            break;
+        case LVAL_BIG:
+            lbig_print(v->big);
+            break;
+        case LVAL_DBL:
+            lval_print_dbl(v->dbl);
+            break;
+        case LVAL_ARR:
+            putchar('[');
+            for(int i = 0; i < v->count; i++) {
+                if(i) {putchar(' ');}
+                if(v->arr->dbl) {
+                    lval_print_dbl(v->arr->f[i]);
+                } else {
+                    printf("%li", (long)v->arr->i[i]);
+                }
+            }
+            putchar(']');
+            break;
+        case LVAL_MAT:
+            putchar('[');
+            for(int i = 0; i < v->mat->rows; i++) {
+                if(i) {putchar(' ');}
+                putchar('[');
+                for(int j = 0; j < v->mat->cols; j++) {
+                    if(j) {putchar(' ');}
+                    lval_print_dbl(v->mat->d[(long)i * v->mat->cols + j]);
+                }
+                putchar(']');
+            }
+            putchar(']');
             break;
             
         /* if it is an error */
@@ -1108,11 +5321,18 @@ void lval_print(lval* v) {
             lval_print_str(v);
             break;
         case LVAL_FUN:
-            if (v->builtin) {
+            if (lval_builtin(v)) {
                 printf("<builtin>");
             } else {
-                printf("(\\ "); lval_print(v->formals);
-                putchar(' '); lval_print(v->body); putchar(')');
+                /* a partial application shows the formals still missing */
+                printf("(\\ {");
+                lval* formals = v->fn->formals;
+                int from = v->fn->args ? v->fn->args->count : 0;
+                for(int i = from; i < formals->count; i++) {
+                    lval_print(formals->cell[i]);
+                    if(i != formals->count-1) {putchar(' ');}
+                }
+                printf("} "); lval_print(v->fn->body); putchar(')');
             }
             break;
         case LVAL_SEXPR:
@@ -1121,6 +5341,11 @@ void lval_print(lval* v) {
         case LVAL_QEXPR:
             lval_expr_print(v, '{', '}');
             break;
+        case LVAL_VEC:
+            putchar('{');
+            lvec_print(v, 1);
+            putchar('}');
+            break;
         case LVAL_EXIT:
             printf("Exit call... \n");
     }
@@ -1146,6 +5371,18 @@ void lval_expr_print(lval* v, char open, char close) {
     putchar(close);
 }
 
+/* print a decimal with as few digits as read back the same, */
+/* always with a point so it doesn't look like an integer */
+void lval_print_dbl(double x) {
+    char buf[32];
+    for(int p = 15; p <= 17; p++) {
+        snprintf(buf, sizeof(buf), "%.*g", p, x);
+        if(strtod(buf, NULL) == x) {break;}
+    }
+    if(!strpbrk(buf, ".eni")) {strcat(buf, ".0");}
+    printf("%s", buf);
+}
+
 /* print an lval string */
 void lval_print_str(lval* v) {
     /* make a copy of the string */
@@ -1175,16 +5412,43 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "slice", builtin_slice);
     
     /* mathematical functions */
     lenv_add_builtin(e, "+", builtin_add);
     lenv_add_builtin(e, "-", builtin_sub);
     lenv_add_builtin(e, "*", builtin_mul);
     lenv_add_builtin(e, "/", builtin_div);
+    lenv_add_builtin(e, "%", builtin_mod);
+    lenv_add_builtin(e, "^", builtin_pow);
+    lenv_add_builtin(e, "sqrt", builtin_sqrt);
+    lenv_add_builtin(e, "exp", builtin_exp);
+    lenv_add_builtin(e, "log", builtin_log);
+    lenv_add_builtin(e, "sin", builtin_sin);
+    lenv_add_builtin(e, "cos", builtin_cos);
+    lenv_add_builtin(e, "floor", builtin_floor);
+    lenv_add_builtin(e, "array", builtin_array);
+    lenv_add_builtin(e, "array_list", builtin_array_list);
+    lenv_add_builtin(e, "sum", builtin_sum);
+    lenv_add_builtin(e, "min", builtin_min);
+    lenv_add_builtin(e, "max", builtin_max);
+    lenv_add_builtin(e, "dot", builtin_dot);
+    lenv_add_builtin(e, "matrix", builtin_matrix);
+    lenv_add_builtin(e, "reshape", builtin_reshape);
+    lenv_add_builtin(e, "shape", builtin_shape);
+    lenv_add_builtin(e, "matmul", builtin_matmul);
+    lenv_add_builtin(e, "transpose", builtin_transpose);
+    lenv_add_builtin(e, "row", builtin_row);
+    lenv_add_builtin(e, "col", builtin_col);
+    lenv_add_builtin(e, "row_sums", builtin_row_sums);
+    lenv_add_builtin(e, "col_sums", builtin_col_sums);
     
     /* Variable functions */
     lenv_add_builtin(e, "\\",  builtin_lambda);
     lenv_add_builtin(e, "def", builtin_def);
+    lenv_add_builtin(e, "fun", builtin_fun);
     lenv_add_builtin(e, "=",   builtin_put);
     
     /* Comparision functions */
@@ -1202,71 +5466,214 @@ void lenv_add_builtins(lenv* e) {
     lenv_add_builtin(e, "load", builtin_load);
     lenv_add_builtin(e, "print", builtin_print);
     lenv_add_builtin(e, "error", builtin_error);
+    lenv_add_builtin(e, "gc_stats", builtin_gc_stats);
+    lenv_add_builtin(e, "gc_budget", builtin_gc_budget);
+    lenv_add_builtin(e, "jit_threshold", builtin_jit_threshold);
+    lenv_add_builtin(e, "mem_stats", builtin_mem_stats);
+    lenv_add_builtin(e, "opt_stats", builtin_opt_stats);
 }
 
 /* construct a new lenv */
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lenv_alloc();
     e->par = NULL;
     e->count = 0;
+    e->cap = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->index = NULL;
+    e->index_cap = 0;
     return e;
 }
 
-/* deletes an lenv */
+/* drops a reference to an lenv, the last one hands it to the collector */
 void lenv_del(lenv* e) {
+    if(--e->refs > 0) {return;}
+    if(gc.ndead_envs == gc.dead_envs_cap) {
+        gc.dead_envs_cap = gc.dead_envs_cap ? gc.dead_envs_cap * 2 : 1024;
+        gc.dead_envs = realloc(gc.dead_envs, sizeof(lenv*) * gc.dead_envs_cap);
+    }
+    gc.dead_envs[gc.ndead_envs++] = e;
+    gc.dead_work += 1 + e->count;
+}
+
+/* frees a dead lenv, returning the work done */
+long lenv_release(lenv* e) {
     for(int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
         lval_del(e->vals[i]);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    /* release the parent unless it is the global environment */
+    if(e->par && e->par->par) {lenv_del(e->par);}
+    long work = 1 + e->count;
+    lenv_free(e);
+    return work;
 }
 
-/* get a value from an lenv variable */
-lval* lenv_get(lenv* e, lval* k) {
-    /*iterate over all items in environment */
+/* frees the memory owned by an lenv itself, but not what it points to */
+void lenv_free(lenv* e) {
+    lslab_free(e->syms, e->cap);
+    lslab_free(e->vals, e->cap);
+    free(e->index);
+    if(e->grown) {lenv_grown--;}
+    e->refs = 0;
+    lpool_free(&gc.envs, e);
+}
+
+/* frames for calls are reused rather than freed, kept in a list for */
+/* each size linked through par - calls of the same size reuse them */
+#define LFRAME_MAX 8
+lenv* lenv_frames[LFRAME_MAX + 1];
+
+/* returns an empty frame inside par with room for n bindings */
+lenv* lenv_frame(lenv* par, int n) {
+    lenv* e;
+    if(n <= LFRAME_MAX && lenv_frames[n]) {
+        e = lenv_frames[n];
+        lenv_frames[n] = e->par;
+        e->refs = 1;
+        e->grown = 0;
+        gc.envs.live++;
+    } else {
+        e = lenv_alloc();
+        e->cap = n;
+        e->syms = lslab_alloc(n);
+        e->vals = lslab_alloc(n);
+        e->index = NULL;
+        e->index_cap = 0;
+    }
+    e->par = lenv_ref(par);
+    e->count = 0;
+    return e;
+}
+
+/* binds a name in a frame that has room for it, taking the value */
+void lenv_bind(lenv* e, char* sym, lval* v) {
+    /* a repeated formal is bound to the last argument for it */
+    for(int i = 0; i < e->count; i++) {
+        if(e->syms[i] == sym) {lval_del(e->vals[i]); e->vals[i] = v; return;}
+    }
+    e->syms[e->count] = sym;
+    e->vals[e->count] = v;
+    e->count++;
+    lenv_index(e, e->count-1);
+}
+
+/* ends the call a frame was made for */
+void lenv_frame_del(lenv* e) {
+    if(e->refs > 1 || e->cap > LFRAME_MAX || e->index) {
+        /* a closure made in the call still holds on to it, so a cycle */
+        /* through it must be found by the next collection */
+        if(e->refs > 1 && e->gen != GEN_YOUNG) {lenv_young(e);}
+        lenv_del(e);
+        return;
+    }
     for(int i = 0; i < e->count; i++) {
-        /* Check if the stored string matches the symbol string */
-        /* If it does, return a copy of the value */
-        if(strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+        lval_del(e->vals[i]);
+    }
+    if(e->par->par) {lenv_del(e->par);}
+    if(e->grown) {lenv_grown--;}
+    
+    /* unused frames aren't in the nursery, they are added back if they */
+    /* are ever held by a closure */
+    e->refs = 0;
+    e->gen = GEN_OLD;
+    e->par = lenv_frames[e->cap];
+    lenv_frames[e->cap] = e;
+    gc.envs.live--;
+}
+
+/* takes a reference to an lenv */
+lenv* lenv_ref(lenv* e) {
+    /* the global environment lives until main deletes it */
+    if(e->par) {e->refs++;}
+    return e;
+}
+
+/* hashes an interned name by its address */
+size_t lenv_hash(char* sym) {
+    size_t h = (size_t)sym >> 4;
+    h *= 2654435761u;
+    return h ^ (h >> 15);
+}
+
+/* returns the slot a name is bound in, or -1 if it isn't in this lenv */
+int lenv_find(lenv* e, char* sym) {
+    if(e->index) {
+        size_t mask = e->index_cap - 1;
+        for(size_t i = lenv_hash(sym) & mask; e->index[i]; i = (i+1) & mask) {
+            if(e->syms[e->index[i]-1] == sym) {return e->index[i]-1;}
         }
+        return -1;
+    }
+    
+    /* small frames are just scanned */
+    for(int i = 0; i < e->count; i++) {
+        if(e->syms[i] == sym) {return i;}
+    }
+    return -1;
+}
+
+/* adds a slot to the hash index, building or growing it as needed */
+void lenv_index(lenv* e, int slot) {
+    if(e->count <= LENV_HASH_MIN) {return;}
+    
+    /* keep the table at most half full, rehashing every slot if not */
+    if(e->count * 2 > e->index_cap) {
+        free(e->index);
+        if(e->index_cap == 0) {e->index_cap = 16;}
+        while(e->count * 2 > e->index_cap) {e->index_cap *= 2;}
+        e->index = calloc(e->index_cap, sizeof(int));
+        for(int i = 0; i < e->count; i++) {lenv_index(e, i);}
+        return;
     }
     
-    /* if no symbol check in parent otherwise error */
-    if(e->par) {
-        return lenv_get(e->par, k);
-    } else { 
-        return lval_err("Unbound Symbol '%s'", k->sym);
+    size_t mask = e->index_cap - 1;
+    size_t i = lenv_hash(e->syms[slot]) & mask;
+    while(e->index[i]) {i = (i+1) & mask;}
+    e->index[i] = slot + 1;
+}
+
+/* get a value from an lenv variable */
+lval* lenv_get(lenv* e, lval* k) {
+    /* search each environment up to the global one */
+    for(; e; e = e->par) {
+        int i = lenv_find(e, k->sym);
+        /* If it is bound, return a copy of the value */
+        if(i >= 0) {return lval_copy(e->vals[i]);}
     }
+    return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
 /* set a value for an lenv variable */
 void lenv_put(lenv* e, lval* k, lval* v) {
-    /* Iterate over all items in environment */
-    /* This is to see if variable already exists */
-    for(int i = 0; i < e->count; i++) {
-        /* If variable is found delete item at that position */
-        /* And replace with variable supplied by user */
-        if(strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    if(e == lenv_root) {
+        lenv_version++;
+        lopt_rebind(k->sym);
     }
     
-    /* if no existing entry found allocate space for new entry */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+    /* If variable already exists replace its value */
+    int i = lenv_find(e, k->sym);
+    if(i >= 0) {
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_copy(v);
+        return;
+    }
+    
+    /* if no existing entry found make space for a new one */
+    if(e->count == e->cap) {
+        int cap = e->cap ? e->cap * 2 : 4;
+        e->vals = lslab_resize(e->vals, e->cap, cap);
+        e->syms = lslab_resize(e->syms, e->cap, cap);
+        e->cap = cap;
+    }
     
-    /* copy contents of lval and symbol string into new location */
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym+1));
-    strcpy(e->syms[e->count-1], k->sym);
+    if(e != lenv_root && !e->grown) {e->grown = 1; lenv_grown++;}
+    
+    /* copy contents of lval and share the interned name */
+    e->vals[e->count] = lval_copy(v);
+    e->syms[e->count] = k->sym;
+    e->count++;
+    lenv_index(e, e->count-1);
 }
 
 /* insert values into global environment */
@@ -1277,21 +5684,422 @@ void lenv_def(lenv* e, lval* k, lval* v) {
     lenv_put(e, k, v);
 }
 
-/* method for copying an environment */
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+/* allocates an object from a pool */
+void* lpool_alloc(lpool* p) {
+    p->allocs++;
+    p->live++;
+    if(p->nfree) {return p->free[--p->nfree];}
+    
+    /* start a new chunk when the current one is used up */
+    if(p->nchunks == 0 || p->used == p->per_chunk) {
+        if(p->per_chunk == 0) {p->per_chunk = (64 * 1024) / p->size;}
+        p->nchunks++;
+        p->chunks = realloc(p->chunks, sizeof(char*) * p->nchunks);
+        p->chunks[p->nchunks-1] = malloc(p->size * p->per_chunk);
+        p->used = 0;
     }
-    return n;
+    return p->chunks[p->nchunks-1] + p->size * p->used++;
+}
+
+/* returns an object to its pool */
+void lpool_free(lpool* p, void* x) {
+    p->live--;
+    if(p->nfree == p->free_cap) {
+        p->free_cap = p->free_cap ? p->free_cap * 2 : 1024;
+        p->free = realloc(p->free, sizeof(void*) * p->free_cap);
+    }
+    p->free[p->nfree++] = x;
+}
+
+/* the size class for an array of n pointers, -1 if it needs none */
+int lslab_class(int n) {
+    if(n == 0) {return -1;}
+    int c = 0;
+    while((1 << c) < n) {c++;}
+    return c;
+}
+
+/* allocates an array with room for n pointers */
+void* lslab_alloc(int n) {
+    int c = lslab_class(n);
+    if(c < 0) {return NULL;}
+    gc.debt += n;
+    if(c < LSLAB_CLASSES) {return lpool_alloc(&gc.slabs[c]);}
+    return malloc(sizeof(void*) << c);
+}
+
+/* resizes an array of pointers from one length to another */
+/* it only moves when the length changes size class */
+void* lslab_resize(void* x, int from, int to) {
+    int a = lslab_class(from);
+    int b = lslab_class(to);
+    if(a == b) {return x;}
+    if(a >= LSLAB_CLASSES && b >= LSLAB_CLASSES) {
+        return realloc(x, sizeof(void*) << b);
+    }
+    void* y = lslab_alloc(to);
+    if(x && y) {memcpy(y, x, sizeof(void*) * (from < to ? from : to));}
+    lslab_free(x, from);
+    return y;
+}
+
+/* frees an array that has room for n pointers */
+void lslab_free(void* x, int n) {
+    int c = lslab_class(n);
+    if(c < 0) {return;}
+    if(c < LSLAB_CLASSES) {lpool_free(&gc.slabs[c], x);} else {free(x);}
+}
+
+/* allocates an lenv with a single owner */
+lenv* lenv_alloc(void) {
+    lenv* e = lpool_alloc(&gc.envs);
+    e->refs = 1;
+    e->gc_flags = 0;
+    e->grown = 0;
+    lenv_young(e);
+    return e;
+}
+
+/* adds an lenv to the nursery, to be looked at by the next collection */
+void lenv_young(lenv* e) {
+    e->gen = GEN_YOUNG;
+    if(gc.nyoung_envs == gc.young_envs_cap) {
+        gc.young_envs_cap = gc.young_envs_cap ? gc.young_envs_cap * 2 : 1024;
+        gc.young_envs = realloc(gc.young_envs,
+            sizeof(lenv*) * gc.young_envs_cap);
+    }
+    gc.young_envs[gc.nyoung_envs++] = e;
+}
+
+/* sets up the pools and collector before anything is allocated */
+void gc_init(void) {
+    gc.vals.size = sizeof(lval);
+    gc.lists.size = sizeof(llist);
+    gc.envs.size = sizeof(lenv);
+    gc.funcs.size = sizeof(lfunc);
+    gc.vecs.size = sizeof(lvec);
+    gc.budget = GC_BUDGET;
+    for(int c = 0; c < LSLAB_CLASSES; c++) {
+        gc.slabs[c].size = sizeof(void*) << c;
+    }
+}
+
+/* frees dead objects and collects once the nursery is full - only call */
+/* where every lval reference held is counted */
+void gc_safepoint(void) {
+    if(gc.dead_work >= gc.budget) {gc_step();} else {gc.debt = 0;}
+    if(gc.nyoung_vals + gc.nyoung_envs < GC_NURSERY) {return;}
+    
+    /* a full collection once the old generation has doubled */
+    clock_t start = clock();
+    gc_collect(gc.old > 2 * gc.old_at_major + GC_NURSERY);
+    gc_pause(start);
+}
+
+/* frees dead objects until the budget for one step is used up */
+void gc_step(void) {
+    clock_t start = clock();
+    long work = gc.budget + gc.debt;
+    gc.debt = 0;
+    
+    while(work > 0 && (gc.ndead_vals || gc.ndead_envs)) {
+        if(gc.ndead_vals) {
+            lval* v = gc.dead_vals[gc.ndead_vals-1];
+            
+            /* a list too big for this step drops its last items, the */
+            /* rest wait underneath them for a later step */
+            if((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+                && v->count >= work) {
+                gc.dead_work -= work;
+                int n = v->count - work;
+                for(int i = n; i < v->count; i++) {lval_del(v->cell[i]);}
+                v->count = n;
+                break;
+            }
+            gc.ndead_vals--;
+            long done = lval_release(v);
+            gc.dead_work -= done;
+            work -= done;
+        } else {
+            lenv* e = gc.dead_envs[gc.ndead_envs-1];
+            if(e->count >= work) {
+                gc.dead_work -= work;
+                while(work > 0) {
+                    lval_del(e->vals[--e->count]);
+                    work--;
+                }
+                break;
+            }
+            gc.ndead_envs--;
+            long done = lenv_release(e);
+            gc.dead_work -= done;
+            work -= done;
+        }
+    }
+    gc_pause(start);
+}
+
+/* records a pause in the histogram */
+void gc_pause(clock_t start) {
+    double us = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC;
+    int b = 0;
+    while(b < GC_PAUSE_BUCKETS-1 && us >= (double)(1L << b)) {b++;}
+    gc.pauses[b]++;
+    gc.npauses++;
+    if(us > gc.pause_max) {gc.pause_max = us;}
+}
+
+/* the objects being collected, gathered by gc_collect */
+lval** gc_vals;
+int gc_nvals;
+int gc_vals_cap;
+lenv** gc_envs;
+int gc_nenvs;
+int gc_envs_cap;
+/* objects found live, still to have their edges followed */
+lval** gc_stack_vals;
+int gc_nstack_vals;
+lenv** gc_stack_envs;
+int gc_nstack_envs;
+
+/* adds an lval to the set being collected */
+void gc_candidate_val(lval* v) {
+    if(v->refs == 0 || (v->gc_flags & GC_CANDIDATE)) {return;}
+    v->gc_flags = GC_CANDIDATE;
+    v->gc_refs = v->refs;
+    if(gc_nvals == gc_vals_cap) {
+        gc_vals_cap = gc_vals_cap ? gc_vals_cap * 2 : 1024;
+        gc_vals = realloc(gc_vals, sizeof(lval*) * gc_vals_cap);
+        gc_stack_vals = realloc(gc_stack_vals, sizeof(lval*) * gc_vals_cap);
+    }
+    gc_vals[gc_nvals++] = v;
+}
+
+/* adds an lenv to the set being collected - never the global one */
+void gc_candidate_env(lenv* e) {
+    if(e->refs == 0 || e->par == NULL || (e->gc_flags & GC_CANDIDATE)) {
+        return;
+    }
+    e->gc_flags = GC_CANDIDATE;
+    e->gc_refs = e->refs;
+    if(gc_nenvs == gc_envs_cap) {
+        gc_envs_cap = gc_envs_cap ? gc_envs_cap * 2 : 1024;
+        gc_envs = realloc(gc_envs, sizeof(lenv*) * gc_envs_cap);
+        gc_stack_envs = realloc(gc_stack_envs, sizeof(lenv*) * gc_envs_cap);
+    }
+    gc_envs[gc_nenvs++] = e;
+}
+
+/* calls visit on everything an lval or lenv holds a reference to */
+/* code constants are left out, so anything they hold is kept alive */
+void gc_edges(lval* v, lenv* e, void (*visit)(lval*, lenv*)) {
+    if(v) {
+        switch(v->type) {
+            case LVAL_SEXPR:
+            case LVAL_QEXPR:
+                for(int i = 0; i < v->count; i++) {
+                    if(!LVAL_IMM(v->cell[i])) {visit(v->cell[i], NULL);}
+                }
+                break;
+            case LVAL_FUN:
+                if(v->fn->env->par) {visit(NULL, v->fn->env);}
+                visit(v->fn->formals, NULL);
+                visit(v->fn->body, NULL);
+                if(v->fn->args) {visit(v->fn->args, NULL);}
+                break;
+            case LVAL_VEC:
+                if(v->vec->base) {
+                    visit(v->vec->base, NULL);
+                } else {
+                    visit(v->vec->left, NULL);
+                    visit(v->vec->right, NULL);
+                }
+                break;
+        }
+    } else {
+        for(int i = 0; i < e->count; i++) {
+            if(!LVAL_IMM(e->vals[i])) {visit(e->vals[i], NULL);}
+        }
+        /* the global environment's references aren't counted */
+        if(e->par->par) {visit(NULL, e->par);}
+    }
+}
+
+/* removes a reference made from inside the set being collected */
+void gc_visit_unref(lval* v, lenv* e) {
+    if(v && (v->gc_flags & GC_CANDIDATE)) {v->gc_refs--;}
+    if(e && (e->gc_flags & GC_CANDIDATE)) {e->gc_refs--;}
+}
+
+/* marks a candidate reachable from a live object as live */
+void gc_visit_live(lval* v, lenv* e) {
+    if(v && v->gc_flags == GC_CANDIDATE) {
+        v->gc_flags |= GC_LIVE;
+        gc_stack_vals[gc_nstack_vals++] = v;
+    }
+    if(e && e->gc_flags == GC_CANDIDATE) {
+        e->gc_flags |= GC_LIVE;
+        gc_stack_envs[gc_nstack_envs++] = e;
+    }
+}
+
+/* drops a reference from garbage to anything that isn't garbage */
+void gc_visit_release(lval* v, lenv* e) {
+    if(v && v->gc_flags != GC_CANDIDATE) {lval_del(v);}
+    if(e && e->gc_flags != GC_CANDIDATE) {lenv_del(e);}
+}
+
+/* finds and frees garbage cycles, among young objects or everything */
+/* an object is garbage if every reference to it comes from garbage, */
+/* which needs no roots - references held in C are counted like any */
+void gc_collect(int major) {
+    gc_nvals = 0;
+    gc_nenvs = 0;
+    
+    if(major) {
+        lpool* pools[] = { &gc.vals, &gc.lists };
+        for(int k = 0; k < 2; k++) {
+            lpool* p = pools[k];
+            for(int c = 0; c < p->nchunks; c++) {
+                int n = c == p->nchunks-1 ? p->used : p->per_chunk;
+                for(int i = 0; i < n; i++) {
+                    gc_candidate_val((lval*)(p->chunks[c] + p->size * i));
+                }
+            }
+        }
+        for(int c = 0; c < gc.envs.nchunks; c++) {
+            lenv* chunk = (lenv*)gc.envs.chunks[c];
+            int n = c == gc.envs.nchunks-1 ? gc.envs.used : gc.envs.per_chunk;
+            for(int i = 0; i < n; i++) {gc_candidate_env(&chunk[i]);}
+        }
+    } else {
+        for(int i = 0; i < gc.nyoung_vals; i++) {
+            gc_candidate_val(gc.young_vals[i]);
+        }
+        for(int i = 0; i < gc.nyoung_envs; i++) {
+            gc_candidate_env(gc.young_envs[i]);
+        }
+    }
+    
+    /* take away the references candidates make to each other */
+    for(int i = 0; i < gc_nvals; i++) {
+        gc_edges(gc_vals[i], NULL, gc_visit_unref);
+    }
+    for(int i = 0; i < gc_nenvs; i++) {
+        gc_edges(NULL, gc_envs[i], gc_visit_unref);
+    }
+    
+    /* anything still referenced is referenced from outside, so is live */
+    /* along with everything it reaches */
+    gc_nstack_vals = 0;
+    gc_nstack_envs = 0;
+    for(int i = 0; i < gc_nvals; i++) {
+        if(gc_vals[i]->gc_refs > 0) {gc_visit_live(gc_vals[i], NULL);}
+    }
+    for(int i = 0; i < gc_nenvs; i++) {
+        if(gc_envs[i]->gc_refs > 0) {gc_visit_live(NULL, gc_envs[i]);}
+    }
+    while(gc_nstack_vals || gc_nstack_envs) {
+        if(gc_nstack_vals) {
+            gc_edges(gc_stack_vals[--gc_nstack_vals], NULL, gc_visit_live);
+        } else {
+            gc_edges(NULL, gc_stack_envs[--gc_nstack_envs], gc_visit_live);
+        }
+    }
+    
+    /* garbage lets go of live objects, then is freed without recursing */
+    for(int i = 0; i < gc_nvals; i++) {
+        if(gc_vals[i]->gc_flags == GC_CANDIDATE) {
+            gc_edges(gc_vals[i], NULL, gc_visit_release);
+        }
+    }
+    for(int i = 0; i < gc_nenvs; i++) {
+        if(gc_envs[i]->gc_flags == GC_CANDIDATE) {
+            gc_edges(NULL, gc_envs[i], gc_visit_release);
+        }
+    }
+    long live = 0;
+    for(int i = 0; i < gc_nvals; i++) {
+        lval* v = gc_vals[i];
+        int garbage = v->gc_flags == GC_CANDIDATE;
+        v->gc_flags = 0;
+        if(garbage) {
+            lval_free(v);
+        } else if(v->refs > 0) {
+            v->gen = GEN_OLD;
+            live++;
+        }
+    }
+    for(int i = 0; i < gc_nenvs; i++) {
+        lenv* e = gc_envs[i];
+        int garbage = e->gc_flags == GC_CANDIDATE;
+        e->gc_flags = 0;
+        if(garbage) {
+            lenv_free(e);
+        } else if(e->refs > 0) {
+            e->gen = GEN_OLD;
+            live++;
+        }
+    }
+    
+    /* survivors are promoted and the nursery starts again */
+    gc.old = major ? live : gc.old + live;
+    if(major) {gc.old_at_major = gc.old;}
+    gc.nyoung_vals = 0;
+    gc.nyoung_envs = 0;
+}
+
+
+/* hashes a symbol name (FNV-1a) */
+unsigned long lsym_hash(char* s) {
+    unsigned long h = 2166136261UL;
+    for(; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619UL;
+    }
+    return h;
 }
 
+/* returns the single stored copy of a symbol name, adding it if new */
+char* lsym_intern(char* s) {
+    /* grow the table once it is half full */
+    if(symtab.count * 2 >= symtab.cap) {
+        int cap = symtab.cap ? symtab.cap * 2 : 256;
+        char** names = calloc(cap, sizeof(char*));
+        for(int i = 0; i < symtab.cap; i++) {
+            if(!symtab.names[i]) {continue;}
+            unsigned long j = lsym_hash(symtab.names[i]) & (cap-1);
+            while(names[j]) {j = (j+1) & (cap-1);}
+            names[j] = symtab.names[i];
+        }
+        free(symtab.names);
+        symtab.names = names;
+        symtab.cap = cap;
+    }
+    
+    /* linear probe for the name or the empty slot it belongs in */
+    unsigned long i = lsym_hash(s) & (symtab.cap-1);
+    while(symtab.names[i]) {
+        if(strcmp(symtab.names[i], s) == 0) {return symtab.names[i];}
+        i = (i+1) & (symtab.cap-1);
+    }
+    
+    symtab.names[i] = malloc(strlen(s) + 1);
+    strcpy(symtab.names[i], s);
+    symtab.count++;
+    return symtab.names[i];
+}
+
+/* interns the names the evaluator looks for */
+void lsym_init(void) {
+    sym_amp = lsym_intern("&");
+    sym_if = lsym_intern("if");
+    sym_put = lsym_intern("=");
+    sym_def = lsym_intern("def");
+    sym_eval = lsym_intern("eval");
+    sym_load = lsym_intern("load");
+    sym_lambda = lsym_intern("\\");
+}
 
 
 char* ltype_name(int t) {
@@ -1303,6 +6111,11 @@ char* ltype_name(int t) {
         case LVAL_STR: return "String";
         case LVAL_SEXPR: return "S-expression";
         case LVAL_QEXPR: return "Q-expression";
+        case LVAL_VEC: return "Vector";
+        case LVAL_BIG: return "Big number";
+        case LVAL_DBL: return "Decimal";
+        case LVAL_ARR: return "Array";
+        case LVAL_MAT: return "Matrix";
         default: return "Unknown";
     }
 }